@@ -1,13 +1,22 @@
 #include "test_runner.h"
 #include "profile.h"
+#include "combinable.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <utility>
 #include <algorithm>
 #include <random>
+#include <numeric>
+#include <type_traits>
 using namespace std;
 
 template <typename K, typename V, typename Hash = std::hash<K>>
@@ -57,6 +66,154 @@ public:
         return bucket.data.count(key) != 0;
     }
 
+    // Применяет func(value) или func(key, value) к значениям всех ключей
+    // диапазона, захватывая мьютекс каждого бакета один раз на группу ключей.
+    // Порядок обновлений одного и того же ключа сохраняется.
+    template <typename Keys, typename Func>
+    void BatchUpdate(const Keys &keys, Func func)
+    {
+        // Раскладываем ключи по бакетам сортировкой подсчётом: она линейна
+        // и устойчива, поэтому обновления одного ключа идут в исходном порядке
+        vector<size_t> indexes;
+        vector<size_t> offsets(_buckets.size() + 1);
+
+        for (const auto &key : keys)
+        {
+            indexes.push_back(getBucketIndex(key));
+            ++offsets[indexes.back() + 1];
+        }
+
+        partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+        vector<const K *> grouped(indexes.size());
+        auto positions = offsets;
+        auto index = indexes.begin();
+
+        for (const auto &key : keys)
+        {
+            grouped[positions[*index++]++] = &key;
+        }
+
+        for (size_t i = 0; i < _buckets.size(); ++i)
+        {
+            if (offsets[i] == offsets[i + 1])
+            {
+                continue;
+            }
+
+            auto &bucket = _buckets[i];
+            lock_guard<mutex> guard(bucket.locker);
+
+            for (size_t j = offsets[i]; j < offsets[i + 1]; ++j)
+            {
+                const K &key = *grouped[j];
+
+                if constexpr (is_invocable_v<Func &, const K &, V &>)
+                {
+                    func(key, bucket.data[key]);
+                }
+                else
+                {
+                    func(bucket.data[key]);
+                }
+            }
+        }
+    }
+
+    // Буфер обновлений, принадлежащий одному потоку: ключи копятся локально
+    // и применяются через BatchUpdate по заполнении буфера, при разрушении
+    // и общим для карты фоновым потоком не позже чем через max_delay,
+    // поэтому обновления становятся видны, даже если владелец замолчал.
+    // Буфер кольцевой с одним писателем: владелец пишет ключ в свободную
+    // ячейку и публикует её атомарной записью _head, поэтому на горячем пути
+    // нет ни мьютексов, ни атомарных read-modify-write. Читатели (сброс
+    // владельца и фоновый поток) упорядочены _flushLocker и освобождают
+    // ячейки записью _tail.
+    template <typename Func>
+    class BufferedUpdater
+    {
+    public:
+        BufferedUpdater(ConcurrentMap &map, Func func, size_t flush_size, chrono::milliseconds max_delay)
+            : _map(map), _func(move(func)), _ring(max<size_t>(flush_size, 1))
+        {
+            _batch.reserve(_ring.size());
+            _map._flusher->Add(this, [this] { Flush(); }, max_delay);
+        }
+
+        BufferedUpdater(const BufferedUpdater &) = delete;
+        BufferedUpdater &operator=(const BufferedUpdater &) = delete;
+
+        ~BufferedUpdater()
+        {
+            // После Remove фоновый поток уже не обращается к буферу
+            _map._flusher->Remove(this);
+            Flush();
+        }
+
+        void Update(const K &key)
+        {
+            const size_t head = _head.load(memory_order_relaxed);
+            _ring[head % _ring.size()] = key;
+            _head.store(head + 1, memory_order_release);
+
+            // _cachedTail отстаёт от _tail, поэтому настоящий хвост читаем
+            // только когда буфер кажется заполненным
+            if (head + 1 - _cachedTail == _ring.size())
+            {
+                _cachedTail = _tail.load(memory_order_acquire);
+
+                if (head + 1 - _cachedTail == _ring.size())
+                {
+                    Flush();
+                    _cachedTail = head + 1;
+                }
+            }
+        }
+
+        // Сбросы владельца и фонового потока упорядочены _flushLocker,
+        // поэтому обновления одного ключа применяются в порядке Update
+        void Flush()
+        {
+            lock_guard<mutex> guard(_flushLocker);
+            const size_t tail = _tail.load(memory_order_relaxed);
+            const size_t head = _head.load(memory_order_acquire);
+
+            if (tail == head)
+            {
+                return;
+            }
+
+            _batch.clear();
+            for (size_t i = tail; i != head; ++i)
+            {
+                _batch.push_back(_ring[i % _ring.size()]);
+            }
+
+            // Ячейки скопированы: владелец может писать в них, пока мы
+            // применяем пакет к карте
+            _tail.store(head, memory_order_release);
+            _map.BatchUpdate(_batch, _func);
+        }
+
+    private:
+        ConcurrentMap &_map;
+        Func _func;
+        vector<K> _ring;
+        atomic<size_t> _head = 0;
+        atomic<size_t> _tail = 0;
+        size_t _cachedTail = 0;
+        mutex _flushLocker;
+        vector<K> _batch;
+    };
+
+    template <typename Func>
+    BufferedUpdater<Func> MakeBufferedUpdater(
+        Func func, size_t flush_size = 1024, chrono::milliseconds max_delay = chrono::milliseconds(10)
+    )
+    {
+        return {*this, move(func), flush_size, max_delay};
+    }
+
     MapType BuildOrdinaryMap() const
     {
         MapType result;
@@ -71,17 +228,111 @@ public:
     }
 
 private:
+    // Один фоновый поток на карту сбрасывает буферы всех её BufferedUpdater.
+    // Состояние лежит отдельно от карты, чтобы карта оставалась перемещаемой.
+    class UpdaterFlusher
+    {
+    public:
+        ~UpdaterFlusher()
+        {
+            {
+                lock_guard<mutex> guard(_locker);
+                _stopped = true;
+            }
+            _changed.notify_one();
+
+            if (_thread.joinable())
+            {
+                _thread.join();
+            }
+        }
+
+        void Add(const void *owner, function<void()> flush, chrono::milliseconds max_delay)
+        {
+            {
+                lock_guard<mutex> guard(_locker);
+                _updaters[owner] = {move(flush), max_delay};
+
+                if (!_thread.joinable())
+                {
+                    _thread = thread([this] { flushPeriodically(); });
+                }
+            }
+            _changed.notify_one();
+        }
+
+        // Буферы сбрасываются под _locker, поэтому после возврата отсюда
+        // фоновый поток к буферу владельца больше не обратится
+        void Remove(const void *owner)
+        {
+            lock_guard<mutex> guard(_locker);
+            _updaters.erase(owner);
+        }
+
+    private:
+        struct Entry
+        {
+            function<void()> flush;
+            chrono::milliseconds maxDelay;
+        };
+
+        mutex _locker;
+        condition_variable _changed;
+        unordered_map<const void *, Entry> _updaters;
+        bool _stopped = false;
+        thread _thread;
+
+        // Просыпается с периодом, равным наименьшему max_delay среди буферов,
+        // и сбрасывает все непустые: ключ ждёт не дольше одного периода
+        void flushPeriodically()
+        {
+            unique_lock<mutex> lock(_locker);
+
+            while (!_stopped)
+            {
+                _changed.wait(lock, [this] { return _stopped || !_updaters.empty(); });
+
+                if (_stopped)
+                {
+                    break;
+                }
+
+                auto period = chrono::milliseconds::max();
+                for (const auto &[owner, entry] : _updaters)
+                {
+                    period = min(period, entry.maxDelay);
+                }
+
+                if (_changed.wait_for(lock, period, [this] { return _stopped; }))
+                {
+                    break;
+                }
+
+                for (auto &[owner, entry] : _updaters)
+                {
+                    entry.flush();
+                }
+            }
+        }
+    };
+
     Hash _hasher;
     vector<MutexMap> _buckets;
+    unique_ptr<UpdaterFlusher> _flusher = make_unique<UpdaterFlusher>();
+
+    size_t getBucketIndex(const K &key) const
+    {
+        return _hasher(key) % _buckets.size();
+    }
 
     const MutexMap &getBucket(const K &key) const
     {
-        return _buckets[_hasher(key) % _buckets.size()];
+        return _buckets[getBucketIndex(key)];
     }
 
     MutexMap &getBucket(const K &key)
     {
-        return _buckets[_hasher(key) % _buckets.size()];
+        return _buckets[getBucketIndex(key)];
     }
 };
 
@@ -111,6 +362,117 @@ void RunConcurrentUpdates(
     }
 }
 
+void RunBatchUpdates(
+    ConcurrentMap<int, int> &cm, size_t thread_count, int key_count
+)
+{
+    auto kernel = [&cm, key_count](int seed)
+    {
+        vector<int> updates(key_count);
+        iota(begin(updates), end(updates), -key_count / 2);
+        shuffle(begin(updates), end(updates), default_random_engine(seed));
+
+        for (int i = 0; i < 2; ++i)
+        {
+            cm.BatchUpdate(updates, [](int &value)
+            {
+                ++value;
+            });
+        }
+    };
+
+    vector<future<void>> futures;
+    for (size_t i = 0; i < thread_count; ++i)
+    {
+        futures.push_back(async(kernel, i));
+    }
+}
+
+void RunBufferedUpdates(
+    ConcurrentMap<int, int> &cm, size_t thread_count, int key_count
+)
+{
+    auto kernel = [&cm, key_count](int seed)
+    {
+        vector<int> updates(key_count);
+        iota(begin(updates), end(updates), -key_count / 2);
+        shuffle(begin(updates), end(updates), default_random_engine(seed));
+
+        auto updater = cm.MakeBufferedUpdater([](int &value)
+        {
+            ++value;
+        });
+
+        for (int i = 0; i < 2; ++i)
+        {
+            for (auto key : updates)
+            {
+                updater.Update(key);
+            }
+        }
+    };
+
+    vector<future<void>> futures;
+    for (size_t i = 0; i < thread_count; ++i)
+    {
+        futures.push_back(async(kernel, i));
+    }
+}
+
+// Каждый поток копит приращения в своей локальной карте, а затем
+// итог сливается в ConcurrentMap одним BatchUpdate на поток
+void RunCombinedUpdates(
+    ConcurrentMap<int, int> &cm, size_t thread_count, int key_count
+)
+{
+    using Deltas = unordered_map<int, int>;
+    Combinable<Deltas> deltas;
+
+    auto kernel = [&deltas, key_count](int seed)
+    {
+        vector<int> updates(key_count);
+        iota(begin(updates), end(updates), -key_count / 2);
+        shuffle(begin(updates), end(updates), default_random_engine(seed));
+
+        auto access = deltas.GetAccess();
+        for (int i = 0; i < 2; ++i)
+        {
+            for (auto key : updates)
+            {
+                access.ref_to_value[key]++;
+            }
+        }
+    };
+
+    {
+        vector<future<void>> futures;
+        for (size_t i = 0; i < thread_count; ++i)
+        {
+            futures.push_back(async(launch::async, kernel, i));
+        }
+    }
+
+    const Deltas merged = deltas.Combine([](Deltas &result, const Deltas &shard)
+    {
+        for (const auto &[key, delta] : shard)
+        {
+            result[key] += delta;
+        }
+    });
+
+    vector<int> keys;
+    keys.reserve(merged.size());
+    for (const auto &[key, delta] : merged)
+    {
+        keys.push_back(key);
+    }
+
+    cm.BatchUpdate(keys, [&merged](int key, int &value)
+    {
+        value += merged.at(key);
+    });
+}
+
 void TestConcurrentUpdate()
 {
     const size_t thread_count = 3;
@@ -127,6 +489,102 @@ void TestConcurrentUpdate()
     }
 }
 
+void TestBatchUpdate()
+{
+    const size_t thread_count = 3;
+    const size_t key_count = 50000;
+
+    for (auto run : {RunBatchUpdates, RunBufferedUpdates, RunCombinedUpdates})
+    {
+        ConcurrentMap<int, int> cm(thread_count);
+        run(cm, thread_count, key_count);
+
+        const auto result = std::as_const(cm).BuildOrdinaryMap();
+        ASSERT_EQUAL(result.size(), key_count);
+        for (auto& [k, v] : result)
+        {
+            AssertEqual(v, 6, "Key = " + to_string(k));
+        }
+    }
+}
+
+void TestBatchUpdateRepeatedKeys()
+{
+    ConcurrentMap<int, string> cm(3);
+    const vector<int> keys = {1, 2, 1, 3, 1, 2};
+
+    cm.BatchUpdate(keys, [](string &value)
+    {
+        value += static_cast<char>('a' + value.size());
+    });
+
+    ASSERT_EQUAL(cm.At(1).ref_to_value, "abc");
+    ASSERT_EQUAL(cm.At(2).ref_to_value, "ab");
+    ASSERT_EQUAL(cm.At(3).ref_to_value, "a");
+}
+
+void TestBufferedUpdaterFlushesByTime()
+{
+    ConcurrentMap<int, int> cm(3);
+    auto updater = cm.MakeBufferedUpdater([](int &value)
+    {
+        ++value;
+    }, 1024, chrono::milliseconds(5));
+
+    updater.Update(1);
+    updater.Update(2);
+    updater.Update(1);
+
+    // Буфер не заполнен и владелец больше ничего не вызывает
+    const auto deadline = chrono::steady_clock::now() + chrono::seconds(5);
+    while (!cm.Has(2) && chrono::steady_clock::now() < deadline)
+    {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+
+    ASSERT(cm.Has(2));
+    ASSERT_EQUAL(cm.At(1).ref_to_value, 2);
+}
+
+void TestBufferedUpdatersShareFlusher()
+{
+    ConcurrentMap<int, int> cm(7);
+    const int key_count = 1000;
+
+    // Маленький буфер и короткая задержка: фоновый поток забирает ключи,
+    // пока владельцы продолжают писать в те же кольцевые буферы
+    auto kernel = [&cm, key_count]
+    {
+        auto updater = cm.MakeBufferedUpdater([](int &value)
+        {
+            ++value;
+        }, 8, chrono::milliseconds(1));
+
+        for (int i = 0; i < 100; ++i)
+        {
+            for (int key = 0; key < key_count; ++key)
+            {
+                updater.Update(key);
+            }
+        }
+    };
+
+    vector<future<void>> futures;
+    for (int i = 0; i < 4; ++i)
+    {
+        futures.push_back(async(launch::async, kernel));
+    }
+    for (auto &f : futures)
+    {
+        f.get();
+    }
+
+    for (int key = 0; key < key_count; ++key)
+    {
+        ASSERT_EQUAL(cm.At(key).ref_to_value, 400);
+    }
+}
+
 void TestReadAndWrite()
 {
     ConcurrentMap<size_t, string> cm(5);
@@ -180,6 +638,24 @@ void TestSpeedup()
         LOG_DURATION("100 locks");
         RunConcurrentUpdates(many_locks, 4, 50000);
     }
+    {
+        ConcurrentMap<int, int> many_locks(100);
+
+        LOG_DURATION("100 locks, batch");
+        RunBatchUpdates(many_locks, 4, 50000);
+    }
+    {
+        ConcurrentMap<int, int> many_locks(100);
+
+        LOG_DURATION("100 locks, buffered");
+        RunBufferedUpdates(many_locks, 4, 50000);
+    }
+    {
+        ConcurrentMap<int, int> many_locks(100);
+
+        LOG_DURATION("100 locks, combined");
+        RunCombinedUpdates(many_locks, 4, 50000);
+    }
 }
 
 void TestConstAccess()
@@ -310,6 +786,10 @@ int main()
 {
     TestRunner tr;
     RUN_TEST(tr, TestConcurrentUpdate);
+    RUN_TEST(tr, TestBatchUpdate);
+    RUN_TEST(tr, TestBatchUpdateRepeatedKeys);
+    RUN_TEST(tr, TestBufferedUpdaterFlushesByTime);
+    RUN_TEST(tr, TestBufferedUpdatersShareFlusher);
     RUN_TEST(tr, TestReadAndWrite);
     RUN_TEST(tr, TestSpeedup);
     RUN_TEST(tr, TestConstAccess);
@@ -1,11 +1,31 @@
 #include "test_runner.h"
+#include "profile.h"
+#include "mapped_file.h"
+#include "hash_utils.h"
 
 #include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <set>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 vector<string> ReadDomains(istream &in)
@@ -41,9 +61,78 @@ bool reversedCmpLess(const string_view &a, const string_view &b)
     return a.size() < b.size();
 }
 
+// То же сравнение, но с конца блоками: по 16 байт через SSE2 и по 8 байт
+// машинными словами. Первый с конца различающийся байт блока находится
+// по старшему биту маски несовпадений, порядок совпадает с reversedCmpLess.
+// Строки короче блока SSE2 обычно различаются уже в последнем байте,
+// для них побайтовый цикл быстрее.
+bool reversedCmpLessFast(const string_view &a, const string_view &b)
+{
+    const char *endA = a.data() + a.size();
+    const char *endB = b.data() + b.size();
+    size_t rest = min(a.size(), b.size());
+
+#ifdef __SSE2__
+    if (rest >= 16)
+    {
+        while (rest >= 16)
+        {
+            const __m128i blockA = _mm_loadu_si128(reinterpret_cast<const __m128i *>(endA - 16));
+            const __m128i blockB = _mm_loadu_si128(reinterpret_cast<const __m128i *>(endB - 16));
+            const uint32_t differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(blockA, blockB)) & 0xFFFF;
+
+            if (differ)
+            {
+                const int i = 31 - __builtin_clz(differ);
+                return endA[i - 16] < endB[i - 16];
+            }
+
+            endA -= 16;
+            endB -= 16;
+            rest -= 16;
+        }
+
+        // На x86 порядок байтов прямой: старший байт слова лежит ближе к концу
+        while (rest >= 8)
+        {
+            uint64_t wordA;
+            uint64_t wordB;
+            memcpy(&wordA, endA - 8, 8);
+            memcpy(&wordB, endB - 8, 8);
+
+            if (const uint64_t differ = wordA ^ wordB)
+            {
+                const int i = (63 - __builtin_clzll(differ)) / 8;
+                return endA[i - 8] < endB[i - 8];
+            }
+
+            endA -= 8;
+            endB -= 8;
+            rest -= 8;
+        }
+    }
+#endif
+
+    for (; rest > 0; --rest)
+    {
+        --endA;
+        --endB;
+
+        if (*endA != *endB)
+        {
+            return *endA < *endB;
+        }
+    }
+
+    return a.size() < b.size();
+}
+
 void SortByReversed(vector<string> &v)
 {
-    sort(v.begin(), v.end(), reversedCmpLess);
+    sort(v.begin(), v.end(), [](const string &a, const string &b)
+    {
+        return reversedCmpLessFast(a, b);
+    });
 }
 bool DomainBanned(const string &domain, const vector<string> &banned)
 {
@@ -63,11 +152,11 @@ bool DomainBanned(const string &domain, const vector<string> &banned)
     }
 
     vector<string>::const_iterator first, last;
-    last = upper_bound(banned.begin(), banned.end(), domain, reversedCmpLess);
+    last = upper_bound(banned.begin(), banned.end(), domain, reversedCmpLessFast);
 
     if (!subdomains.empty())
     {
-        first = lower_bound(banned.begin(), banned.end(), subdomains[0], reversedCmpLess);
+        first = lower_bound(banned.begin(), banned.end(), subdomains[0], reversedCmpLessFast);
     }
     else
     {
@@ -76,97 +165,1762 @@ bool DomainBanned(const string &domain, const vector<string> &banned)
 
     for (const auto &i : subdomains)
     {
-        first = lower_bound(first, last, i, reversedCmpLess);
+        first = lower_bound(first, last, i, reversedCmpLessFast);
 
-        if (*first == i)
+        if (first != last && *first == i)
         {
             return true;
         }
     }
 
-    return *prev(last) == domain;
+    return last != banned.begin() && *prev(last) == domain;
 }
 
-void mainCycle(istream &in, ostream &out)
+// Сжатое префиксное дерево по развёрнутым запрещённым доменам. Цепочки
+// вершин с единственным потомком склеены в одно ребро, метки рёбер хранятся
+// в прямом порядке в общем буфере. Дети вершины лежат подряд и упорядочены
+// по последнему байту метки, поэтому нужный ребёнок ищется двоичным поиском.
+// Проверка домена — один проход по его байтам с конца без выделений памяти.
+// Массивы можно сохранить в файл и потом работать прямо с его отображением
+// в память, без разбора и сортировки.
+class DomainTrie
 {
-    const vector<string> banned_domains = [&in]{
-        auto v = ReadDomains(in);
-        SortByReversed(v);
-        return v;
-    }();
-    const vector<string> domains_to_check = ReadDomains(in);
+public:
+    DomainTrie() : DomainTrie(vector<string>{})
+    {
+    }
+
+    DomainTrie(const DomainTrie &) = delete;
+    DomainTrie &operator=(const DomainTrie &) = delete;
+    DomainTrie(DomainTrie &&) = default;
+    DomainTrie &operator=(DomainTrie &&) = default;
+
+    explicit DomainTrie(const vector<string> &banned) : DomainTrie(ReversedSet(banned), SORTED_REVERSED)
+    {
+    }
+
+    // Строит дерево по уже развёрнутым, отсортированным и уникальным доменам
+    struct SortedReversedTag
+    {
+    };
+    static constexpr SortedReversedTag SORTED_REVERSED{};
+
+    DomainTrie(const vector<string> &reversed, SortedReversedTag)
+    {
+        build(reversed);
+        attach(_nodes.data(), _firstBytes.data(), _labels.data(), _nodes.size(), _labels.size());
+    }
 
-    for (const auto &i : domains_to_check)
+    // Формат файла: заголовок, массив вершин, массив первых байтов меток
+    // и буфер меток. Числа хранятся в порядке байтов машины.
+    void Save(const string &path) const
     {
-        if (DomainBanned(i, banned_domains))
+        Header header{};
+        copy(begin(MAGIC), end(MAGIC), header.magic);
+        header.nodeCount = _nodeCount;
+        header.labelSize = _labelSize;
+
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(_nodeData), _nodeCount * sizeof(Node));
+        out.write(reinterpret_cast<const char *>(_firstData), _nodeCount);
+        out.write(_labelData, _labelSize);
+
+        if (!out)
         {
-            out << "Bad" << endl;
+            throw runtime_error("failed to write " + path);
         }
-        else
+    }
+
+    // Отображает файл в память и работает прямо с ним. Проверяются
+    // только границы ссылок, значения флагов и то, что дети идут после
+    // родителя, чтобы испорченный файл не привёл к чтению за пределами
+    // отображения или к зацикливанию поиска. Суммы считаются в 64 битах
+    // и не переполняются.
+    static DomainTrie Load(const string &path)
+    {
+        DomainTrie trie{EmptyTag()};
+        trie._file = MappedFile(path);
+
+        const char *data = trie._file.Data();
+        const size_t size = trie._file.Size();
+        const auto corrupted = runtime_error("corrupted domain trie " + path);
+
+        if (size < sizeof(Header))
+        {
+            throw corrupted;
+        }
+
+        const auto &header = *reinterpret_cast<const Header *>(data);
+        const size_t nodeCount = header.nodeCount;
+        const size_t labelSize = header.labelSize;
+
+        if (!equal(begin(MAGIC), end(MAGIC), header.magic) || nodeCount == 0
+            || nodeCount > (size - sizeof(Header)) / (sizeof(Node) + 1)
+            || size - sizeof(Header) - nodeCount * (sizeof(Node) + 1) != labelSize)
         {
-            out << "Good" << endl;
+            throw corrupted;
         }
+
+        const auto *nodes = reinterpret_cast<const Node *>(data + sizeof(Header));
+        const auto *firstBytes = reinterpret_cast<const unsigned char *>(nodes + nodeCount);
+
+        for (size_t i = 0; i < nodeCount; ++i)
+        {
+            const Node &node = nodes[i];
+
+            if (uint64_t(node.firstChild) + node.childCount > nodeCount
+                || (node.childCount > 0 && node.firstChild <= i)
+                || uint64_t(node.labelOffset) + node.labelLength > labelSize
+                || node.terminal > 1)
+            {
+                throw corrupted;
+            }
+        }
+
+        trie.attach(nodes, firstBytes, reinterpret_cast<const char *>(firstBytes + nodeCount), nodeCount, labelSize);
+        return trie;
     }
-}
 
-void testSorting(vector<string> source, const vector<string> &expected)
-{
-    SortByReversed(source);
-    ASSERT_EQUAL(source, expected);
-}
+    // Развёрнутые домены без повторов в порядке сортировки
+    static vector<string> ReversedSet(const vector<string> &domains)
+    {
+        vector<string> reversed;
+        reversed.reserve(domains.size());
 
-void TestSortByReversed()
+        for (const auto &domain : domains)
+        {
+            // Пустой домен ничего не запрещает
+            if (!domain.empty())
+            {
+                reversed.push_back(domain);
+            }
+        }
+
+        // Сортировка по развёрнутым строкам даёт тот же порядок, что и
+        // сортировка развёрнутых копий, но сравнивает блоками
+        SortByReversed(reversed);
+        reversed.erase(unique(reversed.begin(), reversed.end()), reversed.end());
+
+        for (auto &domain : reversed)
+        {
+            reverse(domain.begin(), domain.end());
+        }
+
+        return reversed;
+    }
+
+    // Домен запрещён, если он сам или один из его надоменов есть в списке
+    bool Banned(string_view domain) const
+    {
+        return Banned(domain, [](string_view)
+        {
+            return true;
+        });
+    }
+
+    // То же, но найденный в дереве надомен засчитывается, только если
+    // accept(надомен) вернёт true
+    template <typename Accept>
+    bool Banned(string_view domain, Accept accept) const
+    {
+        uint32_t node = 0;
+        size_t pos = domain.size();
+
+        while (true)
+        {
+            if (_nodeData[node].terminal && (pos == 0 || domain[pos - 1] == '.') && accept(domain.substr(pos)))
+            {
+                return true;
+            }
+
+            if (pos == 0)
+            {
+                return false;
+            }
+
+            const Node &parent = _nodeData[node];
+            const auto first = _firstData + parent.firstChild;
+            const auto last = first + parent.childCount;
+            const auto child = lower_bound(first, last, static_cast<unsigned char>(domain[pos - 1]));
+
+            if (child == last || *child != static_cast<unsigned char>(domain[pos - 1]))
+            {
+                return false;
+            }
+
+            node = child - _firstData;
+            const Node &next = _nodeData[node];
+
+            if (next.labelLength > pos
+                || memcmp(domain.data() + pos - next.labelLength, _labelData + next.labelOffset, next.labelLength) != 0)
+            {
+                return false;
+            }
+
+            pos -= next.labelLength;
+        }
+    }
+
+    // Есть ли домен в списке сам по себе
+    bool Contains(string_view domain) const
+    {
+        return !domain.empty() && Banned(domain, [&domain](string_view suffix)
+        {
+            return suffix.size() == domain.size();
+        });
+    }
+
+    size_t NodeCount() const
+    {
+        return _nodeCount;
+    }
+
+    size_t MemoryUsage() const
+    {
+        return _nodes.capacity() * sizeof(Node) + _firstBytes.capacity() + _labels.capacity() + _file.Size();
+    }
+
+private:
+    struct Node
+    {
+        uint32_t firstChild;
+        uint32_t labelOffset;
+        uint32_t labelLength;
+        uint16_t childCount;
+        // 0 или 1; не bool, чтобы байт из файла не мог быть другим значением bool
+        uint8_t terminal;
+    };
+
+    struct Header
+    {
+        char magic[8];
+        uint64_t nodeCount;
+        uint64_t labelSize;
+    };
+
+    static constexpr char MAGIC[8] = {'D', 'O', 'M', 'T', 'R', 'I', 'E', '1'};
+
+    // Массивы построенного дерева или отображение загруженного файла
+    vector<Node> _nodes;
+    vector<unsigned char> _firstBytes;
+    vector<char> _labels;
+    MappedFile _file;
+
+    // Поиск идёт только через эти указатели
+    const Node *_nodeData = nullptr;
+    const unsigned char *_firstData = nullptr;
+    const char *_labelData = nullptr;
+    size_t _nodeCount = 0;
+    size_t _labelSize = 0;
+
+    struct EmptyTag
+    {
+    };
+
+    explicit DomainTrie(EmptyTag)
+    {
+    }
+
+    void attach(const Node *nodes, const unsigned char *firstBytes, const char *labels, size_t nodeCount, size_t labelSize)
+    {
+        _nodeData = nodes;
+        _firstData = firstBytes;
+        _labelData = labels;
+        _nodeCount = nodeCount;
+        _labelSize = labelSize;
+    }
+
+    // Вершины создаются в порядке обхода в ширину, так что дети каждой
+    // вершины оказываются рядом. Вершине соответствует отрезок
+    // отсортированных строк с общим префиксом длины depth.
+    void build(const vector<string> &reversed)
+    {
+        struct Range
+        {
+            size_t first, last, depth;
+        };
+
+        vector<Range> ranges = {{0, reversed.size(), 0}};
+        _nodes.push_back({0, 0, 0, 0, false});
+        _firstBytes.push_back(0);
+
+        for (size_t node = 0; node < _nodes.size(); ++node)
+        {
+            auto [first, last, depth] = ranges[node];
+
+            if (first < last && reversed[first].size() == depth)
+            {
+                _nodes[node].terminal = 1;
+                ++first;
+            }
+
+            _nodes[node].firstChild = _nodes.size();
+
+            while (first < last)
+            {
+                const unsigned char byte = reversed[first][depth];
+                size_t groupLast = first + 1;
+
+                while (groupLast < last && static_cast<unsigned char>(reversed[groupLast][depth]) == byte)
+                {
+                    ++groupLast;
+                }
+
+                // Строки отсортированы, поэтому общий префикс группы равен
+                // общему префиксу её первой и последней строк
+                const string &lhs = reversed[first];
+                const string &rhs = reversed[groupLast - 1];
+                size_t common = depth + 1;
+
+                while (common < lhs.size() && common < rhs.size() && lhs[common] == rhs[common])
+                {
+                    ++common;
+                }
+
+                const uint32_t labelOffset = _labels.size();
+                _labels.insert(_labels.end(), lhs.rend() - common, lhs.rend() - depth);
+                _nodes.push_back({0, labelOffset, static_cast<uint32_t>(common - depth), 0, false});
+                _firstBytes.push_back(byte);
+                ranges.push_back({first, groupLast, common});
+                ++_nodes[node].childCount;
+                first = groupLast;
+            }
+        }
+    }
+};
+
+bool DomainBanned(const string &domain, const DomainTrie &banned)
 {
-    testSorting({"a"}, {"a"});
-    testSorting({"ac", "ab"}, {"ab", "ac"});
-    testSorting({"abcd", "abcdef", "fxy"}, {"abcd", "abcdef", "fxy"});
-    testSorting({"fxy", "abcd", "abcdef"}, {"abcd", "abcdef", "fxy"});
+    return banned.Banned(domain);
 }
 
-void TestDomainBanned()
+// Блочный фильтр Блума по запрещённым доменам перед точной проверкой.
+// Хеш считается одним проходом по домену с конца, и на каждой границе
+// меток он равен хешу очередного надомена, так что все надомены проверяются
+// без повторного чтения строки. Все биты одного ключа лежат в одном блоке
+// размером с кеш-линию, поэтому проверка ключа — один промах кеша.
+// Ложноотрицательных ответов нет: «нет» означает, что домен чист.
+// Выигрыш есть, только когда дерево проходится глубоко, как под общими
+// длинными суффиксами; на чистом потоке верх дерева лежит в кеше и
+// отсеивает домен быстрее, чем фильтр проверяет все надомены.
+class DomainBloom
 {
-    vector<string> banned = {"ya.ru", "mail.mail.com", "tv", "ru.tv", "", "mail.ru.tv"};
-    SortByReversed(banned);
+public:
+    DomainBloom(const vector<string> &banned, double false_positive_rate)
+    {
+        // Оптимум для обычного фильтра: m/n = -ln p / ln² 2, k = m/n · ln 2
+        const double ln2 = log(2.0);
+        const double bitsPerKey = max(1.0, -log(false_positive_rate) / (ln2 * ln2));
+        _hashCount = clamp<size_t>(lround(bitsPerKey * ln2), 1, 16);
+        _blocks.assign(max<size_t>(1, ceil(banned.size() * bitsPerKey / BLOCK_BITS)), Block{});
 
-    ASSERT_EQUAL(DomainBanned("mail.ya.ru", banned), true);
-    ASSERT_EQUAL(DomainBanned("mail.mail.com", banned), true);
-    ASSERT_EQUAL(DomainBanned("bazooka.tv", banned), true);
-    ASSERT_EQUAL(DomainBanned("wow.mail.mail.com", banned), true);
-    ASSERT_EQUAL(DomainBanned("wow.mail.mail.ru.tv", banned), true);
-    ASSERT_EQUAL(DomainBanned("wow.mail.tu.tv", banned), true);
+        for (const auto &domain : banned)
+        {
+            if (!domain.empty())
+            {
+                add(hashReversed(domain));
+            }
+        }
+    }
 
-    ASSERT_EQUAL(DomainBanned("mail.ya.rf", banned), false);
-    ASSERT_EQUAL(DomainBanned("mail.muil.com", banned), false);
-    ASSERT_EQUAL(DomainBanned("bazooka.ttv", banned), false);
-    ASSERT_EQUAL(DomainBanned("wow.ru.mail.com", banned), false);
-    ASSERT_EQUAL(DomainBanned("", banned), false);
+    bool MayBeBanned(string_view domain) const
+    {
+        uint64_t hash = SEED;
 
-    vector<string> bannedEmpty;
-    ASSERT_EQUAL(DomainBanned("wow.mail.mail.com", bannedEmpty), false);
-}
+        for (size_t pos = domain.size(); pos > 0; --pos)
+        {
+            hash = step(hash, domain[pos - 1]);
 
-void TestMainCycle()
+            if ((pos == 1 || domain[pos - 2] == '.') && mayContain(hash))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    size_t MemoryUsage() const
+    {
+        return _blocks.capacity() * sizeof(Block);
+    }
+
+    size_t HashCount() const
+    {
+        return _hashCount;
+    }
+
+private:
+    static constexpr size_t BLOCK_BITS = 512;
+    static constexpr uint64_t SEED = 14695981039346656037ULL;
+
+    struct alignas(64) Block
+    {
+        uint64_t words[BLOCK_BITS / 64];
+    };
+
+    vector<Block> _blocks;
+    size_t _hashCount;
+
+    static uint64_t step(uint64_t hash, char c)
+    {
+        return (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+
+    static uint64_t hashReversed(string_view domain)
+    {
+        uint64_t hash = SEED;
+
+        for (auto it = domain.rbegin(); it != domain.rend(); ++it)
+        {
+            hash = step(hash, *it);
+        }
+
+        return hash;
+    }
+
+    // Блок выбирается по старшей половине перемешанного хеша, номера битов
+    // в блоке — двойным хешированием по младшей
+    template <typename Visit>
+    bool forEachBit(uint64_t hash, Visit visit) const
+    {
+        const uint64_t mixed = MixHash(hash);
+        const size_t block = (mixed >> 32) % _blocks.size();
+        uint32_t bit = static_cast<uint32_t>(mixed);
+        const uint32_t delta = (bit >> 17 | bit << 15) | 1;
+
+        for (size_t i = 0; i < _hashCount; ++i, bit += delta)
+        {
+            if (!visit(block, bit % BLOCK_BITS))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void add(uint64_t hash)
+    {
+        forEachBit(hash, [this](size_t block, size_t bit)
+        {
+            _blocks[block].words[bit / 64] |= uint64_t(1) << (bit % 64);
+            return true;
+        });
+    }
+
+    bool mayContain(uint64_t hash) const
+    {
+        return forEachBit(hash, [this](size_t block, size_t bit)
+        {
+            return (_blocks[block].words[bit / 64] >> (bit % 64)) & 1;
+        });
+    }
+};
+
+bool DomainBanned(const string &domain, const DomainTrie &banned, const DomainBloom &bloom)
 {
-    stringstream in("4\nya.ru\nmaps.me\nm.ya.ru\ncom\n7\nya.ru\nya.com\nm.maps.me\nmoscow.m.ya.ru\nmaps.com\nmaps.ru\nya.ya\n"), out;
-    mainCycle(in, out);
-    ASSERT_EQUAL(out.str(), "Bad\nBad\nBad\nBad\nBad\nGood\nGood\n");
-    out = stringstream("");
-    in = stringstream("0\n7\nya.ru\nya.com\nm.maps.me\nmoscow.m.ya.ru\nmaps.com\nmaps.ru\nya.ya\n");
-    mainCycle(in, out);
-    ASSERT_EQUAL(out.str(), "Good\nGood\nGood\nGood\nGood\nGood\nGood\n");
-    out = stringstream("");
-    in = stringstream("0\n0");
-    mainCycle(in, out);
-    ASSERT_EQUAL(out.str(), "");
+    return bloom.MayBeBanned(domain) && banned.Banned(domain);
 }
 
-int main()
+// Список запретов, меняющийся на ходу. Дерево неизменяемо, а добавленные
+// и снятые запреты копятся в небольших множествах рядом с ним. Когда
+// изменений набирается больше MIN_CHANGES и восьмой части списка,
+// они сливаются с отсортированным списком развёрнутых доменов за линейное
+// время, и дерево строится заново без сортировки.
+class DynamicDomainFilter
 {
+public:
+    explicit DynamicDomainFilter(const vector<string> &banned)
+        : _reversed(DomainTrie::ReversedSet(banned))
+        , _trie(_reversed, DomainTrie::SORTED_REVERSED)
     {
-        TestRunner tr;
-        RUN_TEST(tr,TestSortByReversed);
-        RUN_TEST(tr,TestDomainBanned);
-        RUN_TEST(tr,TestMainCycle);
+    }
+
+    bool Banned(string_view domain) const
+    {
+        const bool banned = _removed.empty() ? _trie.Banned(domain) : _trie.Banned(domain, [this](string_view suffix)
+        {
+            return _removed.count(suffix) == 0;
+        });
+
+        if (banned || _added.empty())
+        {
+            return banned;
+        }
+
+        for (size_t i = 0; i < domain.size(); ++i)
+        {
+            if ((i == 0 || domain[i - 1] == '.') && _added.count(domain.substr(i)))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Add(const string &domain)
+    {
+        if (domain.empty())
+        {
+            return;
+        }
+
+        if (!_removed.erase(domain) && !_trie.Contains(domain))
+        {
+            _added.insert(domain);
+        }
+
+        changed();
+    }
+
+    void Remove(const string &domain)
+    {
+        if (!_added.erase(domain) && _trie.Contains(domain))
+        {
+            _removed.insert(domain);
+        }
+
+        changed();
+    }
+
+    size_t PendingChanges() const
+    {
+        return _added.size() + _removed.size();
+    }
+
+    // Сливает накопленные изменения с деревом
+    void Merge()
+    {
+        const vector<string> removed = reversed(_removed);
+        const vector<string> added = reversed(_added);
+
+        vector<string> kept;
+        kept.reserve(_reversed.size() - removed.size());
+        set_difference(make_move_iterator(_reversed.begin()), make_move_iterator(_reversed.end()),
+                       removed.begin(), removed.end(), back_inserter(kept));
+
+        _reversed.clear();
+        _reversed.reserve(kept.size() + added.size());
+        merge(make_move_iterator(kept.begin()), make_move_iterator(kept.end()),
+              added.begin(), added.end(), back_inserter(_reversed));
+
+        _trie = DomainTrie(_reversed, DomainTrie::SORTED_REVERSED);
+        _added.clear();
+        _removed.clear();
+    }
+
+private:
+    static constexpr size_t MIN_CHANGES = 1024;
+
+    vector<string> _reversed;
+    DomainTrie _trie;
+    set<string, less<>> _added;
+    set<string, less<>> _removed;
+
+    static vector<string> reversed(const set<string, less<>> &domains)
+    {
+        vector<string> result;
+        result.reserve(domains.size());
+
+        result.assign(domains.begin(), domains.end());
+        SortByReversed(result);
+
+        for (auto &domain : result)
+        {
+            reverse(domain.begin(), domain.end());
+        }
+
+        return result;
+    }
+
+    void changed()
+    {
+        if (PendingChanges() > max(MIN_CHANGES, _reversed.size() / 8))
+        {
+            Merge();
+        }
+    }
+};
+
+// Потоковый режим: после начального списка запретов идут команды по одной
+// на строке: "? домен" — проверка, "+ домен" и "- домен" — добавление
+// и снятие запрета. Ответы сбрасываются, когда во входе не осталось
+// прочитанных данных, чтобы не задерживать интерактивного клиента.
+void streamCycle(istream &in, ostream &out)
+{
+    DynamicDomainFilter filter(ReadDomains(in));
+
+    char command;
+    string domain;
+
+    while (in >> command >> domain)
+    {
+        switch (command)
+        {
+        case '?':
+            out << (filter.Banned(domain) ? "Bad\n" : "Good\n");
+            break;
+        case '+':
+            filter.Add(domain);
+            break;
+        case '-':
+            filter.Remove(domain);
+            break;
+        default:
+            out << "Unknown command " << command << "\n";
+        }
+
+        if (in.rdbuf()->in_avail() <= 0)
+        {
+            out.flush();
+        }
+    }
+
+    out.flush();
+}
+
+// Ответы на отрезок доменов одной строкой. Фильтр Блума, если он есть,
+// отсеивает чистые домены до обращения к дереву.
+string ClassifyRange(const string *first, const string *last, const DomainTrie &banned, const DomainBloom *bloom)
+{
+    string result;
+    result.reserve((last - first) * 5);
+
+    for (; first != last; ++first)
+    {
+        const bool bad = bloom ? DomainBanned(*first, banned, *bloom) : DomainBanned(*first, banned);
+        result += bad ? "Bad\n" : "Good\n";
+    }
+
+    return result;
+}
+
+// Постоянные рабочие потоки для проверки пакетов. Пакет делится между
+// потоками поровну, каждый пишет ответы своей части. Потоки создаются один
+// раз на весь вход, а не на каждый пакет. Дерево не меняется, поэтому
+// потоки читают его без блокировок.
+class BatchClassifier
+{
+public:
+    BatchClassifier(const DomainTrie &banned, const DomainBloom *bloom, size_t thread_count)
+        : _banned(banned), _bloom(bloom), _parts(max<size_t>(thread_count, 1))
+    {
+        for (size_t i = 0; i < _parts.size(); ++i)
+        {
+            _workers.emplace_back([this, i] { work(i); });
+        }
+    }
+
+    BatchClassifier(const BatchClassifier &) = delete;
+    BatchClassifier &operator=(const BatchClassifier &) = delete;
+
+    ~BatchClassifier()
+    {
+        {
+            lock_guard<mutex> guard(_locker);
+            _stopped = true;
+        }
+        _started.notify_all();
+
+        for (auto &worker : _workers)
+        {
+            worker.join();
+        }
+    }
+
+    // Начинает проверку пакета, который не должен меняться до Wait
+    void Start(const vector<string> &batch)
+    {
+        {
+            lock_guard<mutex> guard(_locker);
+            _batch = &batch;
+            _done = 0;
+            ++_generation;
+        }
+        _started.notify_all();
+    }
+
+    // Ответы на пакет из последнего Start в порядке доменов
+    string Wait()
+    {
+        unique_lock<mutex> lock(_locker);
+        _finished.wait(lock, [this] { return _done == _parts.size(); });
+
+        string result;
+        for (auto &part : _parts)
+        {
+            result += part;
+        }
+
+        return result;
+    }
+
+private:
+    const DomainTrie &_banned;
+    const DomainBloom *_bloom;
+    vector<string> _parts;
+    const vector<string> *_batch = nullptr;
+    size_t _generation = 0;
+    size_t _done = 0;
+    bool _stopped = false;
+    mutex _locker;
+    condition_variable _started;
+    condition_variable _finished;
+    vector<thread> _workers;
+
+    void work(size_t index)
+    {
+        size_t seen = 0;
+        unique_lock<mutex> lock(_locker);
+
+        while (true)
+        {
+            _started.wait(lock, [this, seen] { return _stopped || _generation != seen; });
+
+            if (_stopped)
+            {
+                return;
+            }
+
+            seen = _generation;
+            const vector<string> &batch = *_batch;
+            lock.unlock();
+
+            const size_t chunk = (batch.size() + _parts.size() - 1) / _parts.size();
+            const size_t begin = min(index * chunk, batch.size());
+            const size_t end = min(begin + chunk, batch.size());
+            _parts[index] = ClassifyRange(batch.data() + begin, batch.data() + end, _banned, _bloom);
+
+            lock.lock();
+            if (++_done == _parts.size())
+            {
+                _finished.notify_one();
+            }
+        }
+    }
+};
+
+// Домены читаются пакетами по batch_size. Пока пакет проверяется
+// в фоне, читается следующий; ответы пишутся в порядке входа одним
+// блоком на пакет. Если доменов во входе меньше объявленного, проверяются
+// только прочитанные.
+void checkDomains(istream &in, ostream &out, const DomainTrie &banned_domains, const DomainBloom *bloom = nullptr,
+                  size_t thread_count = max(1u, thread::hardware_concurrency()), size_t batch_size = 1 << 16)
+{
+    size_t count = 0;
+    in >> count;
+    batch_size = max<size_t>(batch_size, 1);
+
+    BatchClassifier classifier(banned_domains, bloom, thread_count);
+    vector<string> batch;
+    vector<string> next;
+    bool pending = false;
+
+    while (count > 0 || pending)
+    {
+        next.resize(min(count, batch_size));
+        size_t read = 0;
+
+        // Строки переиспользуются между пакетами, поэтому перед чтением
+        // очищаются: иначе при обрыве входа в них остался бы прежний домен
+        for (; read < next.size(); ++read)
+        {
+            next[read].clear();
+
+            if (!(in >> next[read]))
+            {
+                break;
+            }
+        }
+
+        next.resize(read);
+        count = read < min(count, batch_size) ? 0 : count - read;
+
+        if (pending)
+        {
+            const string text = classifier.Wait();
+            out.write(text.data(), text.size());
+        }
+
+        swap(batch, next);
+        pending = !batch.empty();
+
+        if (pending)
+        {
+            classifier.Start(batch);
+        }
+    }
+
+    out.flush();
+}
+
+// bloom_rate > 0 включает фильтр Блума с такой долей ложных срабатываний
+void mainCycle(istream &in, ostream &out, size_t thread_count = max(1u, thread::hardware_concurrency()),
+               size_t batch_size = 1 << 16, double bloom_rate = 0)
+{
+    const vector<string> banned = ReadDomains(in);
+    const DomainTrie banned_domains(banned);
+    optional<DomainBloom> bloom;
+
+    if (bloom_rate > 0)
+    {
+        bloom.emplace(banned, bloom_rate);
+    }
+
+    checkDomains(in, out, banned_domains, bloom ? &*bloom : nullptr, thread_count, batch_size);
+}
+
+// Параметры синтетической нагрузки для фильтра
+struct WorkloadConfig
+{
+    string name;
+    size_t banned_count;
+    size_t query_count;
+    double hit_ratio;          // доля запросов к запрещённым доменам и их поддоменам
+    double shared_zone_ratio;  // доля доменов под общими длинными суффиксами хостингов
+    size_t max_depth;          // наибольшее число меток перед зоной
+    uint32_t seed = 1;
+};
+
+// Генератор правдоподобных доменов: метки разной длины из букв, цифр
+// и дефисов под настоящими доменами верхнего уровня или под общими
+// зонами хостингов, где у тысяч доменов один длинный суффикс
+class DomainGenerator
+{
+public:
+    explicit DomainGenerator(uint32_t seed) : _gen(seed)
+    {
+    }
+
+    string Domain(size_t max_depth, double shared_zone_ratio)
+    {
+        string result;
+
+        for (size_t depth = uniform_int_distribution<size_t>(1, max_depth)(_gen); depth > 0; --depth)
+        {
+            result += label();
+            result += '.';
+        }
+
+        if (bernoulli_distribution(shared_zone_ratio)(_gen))
+        {
+            return result + pick(SHARED_ZONES);
+        }
+
+        return result + pick(TLDS);
+    }
+
+    vector<string> Banned(const WorkloadConfig &config)
+    {
+        vector<string> result(config.banned_count);
+
+        for (auto &domain : result)
+        {
+            domain = Domain(config.max_depth, config.shared_zone_ratio);
+        }
+
+        return result;
+    }
+
+    // Попадания — запрещённые домены, половина из них с добавленными
+    // поддоменами; промахи — свежие домены той же формы
+    vector<string> Queries(const WorkloadConfig &config, const vector<string> &banned)
+    {
+        vector<string> result(config.query_count);
+        bernoulli_distribution hit(banned.empty() ? 0 : config.hit_ratio);
+
+        for (auto &domain : result)
+        {
+            if (hit(_gen))
+            {
+                domain = banned[uniform_int_distribution<size_t>(0, banned.size() - 1)(_gen)];
+
+                for (size_t extra = _gen() % 3; extra > 0 && _gen() % 2; --extra)
+                {
+                    domain = label() + '.' + domain;
+                }
+            }
+            else
+            {
+                domain = Domain(config.max_depth, config.shared_zone_ratio);
+            }
+        }
+
+        return result;
+    }
+
+    // Вход mainCycle: список запретов и список проверяемых доменов
+    void WriteInput(const WorkloadConfig &config, ostream &out)
+    {
+        const auto banned = Banned(config);
+        const auto queries = Queries(config, banned);
+
+        for (const auto *list : {&banned, &queries})
+        {
+            out << list->size() << '\n';
+            for (const auto &domain : *list)
+            {
+                out << domain << '\n';
+            }
+        }
+    }
+
+private:
+    static const vector<string> TLDS;
+    static const vector<string> SHARED_ZONES;
+
+    mt19937 _gen;
+
+    const string &pick(const vector<string> &options)
+    {
+        return options[uniform_int_distribution<size_t>(0, options.size() - 1)(_gen)];
+    }
+
+    // Длина метки от 1 до 20 со средним около 7, дефис не бывает
+    // первым или последним символом
+    string label()
+    {
+        static const string ALPHABET = "abcdefghijklmnopqrstuvwxyz0123456789";
+        const size_t length = clamp<size_t>(binomial_distribution<size_t>(20, 0.33)(_gen), 1, 20);
+
+        string result(length, 'a');
+        for (size_t i = 0; i < length; ++i)
+        {
+            const bool hyphen = i > 0 && i + 1 < length && _gen() % 16 == 0;
+            result[i] = hyphen ? '-' : ALPHABET[_gen() % (i == 0 ? 26 : ALPHABET.size())];
+        }
+
+        return result;
+    }
+};
+
+const vector<string> DomainGenerator::TLDS = {
+    "com", "com", "com", "net", "org", "ru", "ru", "de", "uk", "io", "info", "xyz", "co.uk", "com.br", "jp"
+};
+
+const vector<string> DomainGenerator::SHARED_ZONES = {
+    "users.cdn-provider.com", "blogspot.com", "github.io", "s3.amazonaws.com",
+    "appspot.com", "herokuapp.com", "narod.ru", "livejournal.com"
+};
+
+void testSorting(vector<string> source, const vector<string> &expected)
+{
+    SortByReversed(source);
+    ASSERT_EQUAL(source, expected);
+}
+
+void TestSortByReversed()
+{
+    testSorting({"a"}, {"a"});
+    testSorting({"ac", "ab"}, {"ab", "ac"});
+    testSorting({"abcd", "abcdef", "fxy"}, {"abcd", "abcdef", "fxy"});
+    testSorting({"fxy", "abcd", "abcdef"}, {"abcd", "abcdef", "fxy"});
+}
+
+void TestReversedCmpLessFast()
+{
+    mt19937 gen(5);
+    uniform_int_distribution<int> length_dist(0, 40);
+    uniform_int_distribution<int> char_dist(-128, 127);
+
+    const string suffix = ".very-long-shared-suffix.example.com";
+    for (int i = 0; i < 100000; ++i)
+    {
+        string a(length_dist(gen), 'x');
+        string b(length_dist(gen), 'x');
+
+        // Редкие различия, чтобы сравнение доходило до разных блоков
+        for (char &c : a)
+        {
+            c = gen() % 8 ? 'x' : static_cast<char>(char_dist(gen));
+        }
+        for (char &c : b)
+        {
+            c = gen() % 8 ? 'x' : static_cast<char>(char_dist(gen));
+        }
+        if (i % 2)
+        {
+            a += suffix;
+            b += suffix;
+        }
+
+        ASSERT_EQUAL(reversedCmpLessFast(a, b), reversedCmpLess(a, b));
+        ASSERT_EQUAL(reversedCmpLessFast(b, a), reversedCmpLess(b, a));
+        ASSERT_EQUAL(reversedCmpLessFast(a, a), false);
+    }
+}
+
+void TestDomainBanned()
+{
+    vector<string> banned = {"ya.ru", "mail.mail.com", "tv", "ru.tv", "", "mail.ru.tv"};
+    SortByReversed(banned);
+
+    ASSERT_EQUAL(DomainBanned("mail.ya.ru", banned), true);
+    ASSERT_EQUAL(DomainBanned("mail.mail.com", banned), true);
+    ASSERT_EQUAL(DomainBanned("bazooka.tv", banned), true);
+    ASSERT_EQUAL(DomainBanned("wow.mail.mail.com", banned), true);
+    ASSERT_EQUAL(DomainBanned("wow.mail.mail.ru.tv", banned), true);
+    ASSERT_EQUAL(DomainBanned("wow.mail.tu.tv", banned), true);
+
+    ASSERT_EQUAL(DomainBanned("mail.ya.rf", banned), false);
+    ASSERT_EQUAL(DomainBanned("mail.muil.com", banned), false);
+    ASSERT_EQUAL(DomainBanned("bazooka.ttv", banned), false);
+    ASSERT_EQUAL(DomainBanned("wow.ru.mail.com", banned), false);
+    ASSERT_EQUAL(DomainBanned("", banned), false);
+
+    vector<string> bannedEmpty;
+    ASSERT_EQUAL(DomainBanned("wow.mail.mail.com", bannedEmpty), false);
+}
+
+void TestDomainTrie()
+{
+    const DomainTrie banned({"ya.ru", "mail.mail.com", "tv", "ru.tv", "", "mail.ru.tv"});
+
+    ASSERT_EQUAL(DomainBanned("mail.ya.ru", banned), true);
+    ASSERT_EQUAL(DomainBanned("mail.mail.com", banned), true);
+    ASSERT_EQUAL(DomainBanned("bazooka.tv", banned), true);
+    ASSERT_EQUAL(DomainBanned("wow.mail.mail.com", banned), true);
+    ASSERT_EQUAL(DomainBanned("wow.mail.mail.ru.tv", banned), true);
+    ASSERT_EQUAL(DomainBanned("wow.mail.tu.tv", banned), true);
+    ASSERT_EQUAL(DomainBanned("tv", banned), true);
+
+    ASSERT_EQUAL(DomainBanned("mail.ya.rf", banned), false);
+    ASSERT_EQUAL(DomainBanned("mail.muil.com", banned), false);
+    ASSERT_EQUAL(DomainBanned("bazooka.ttv", banned), false);
+    ASSERT_EQUAL(DomainBanned("wow.ru.mail.com", banned), false);
+    ASSERT_EQUAL(DomainBanned("aya.ru", banned), false);
+    ASSERT_EQUAL(DomainBanned("ru", banned), false);
+    ASSERT_EQUAL(DomainBanned("", banned), false);
+
+    ASSERT_EQUAL(DomainBanned("wow.mail.mail.com", DomainTrie()), false);
+    ASSERT_EQUAL(DomainBanned("", DomainTrie()), false);
+}
+
+// Случайные домены из коротких меток над маленьким алфавитом, чтобы
+// запросы часто совпадали с запрещёнными доменами или их частями
+vector<string> RandomDomains(size_t count, mt19937 &gen, size_t max_labels = 4, size_t max_label = 3, char max_char = 'c')
+{
+    uniform_int_distribution<size_t> labels_dist(1, max_labels);
+    uniform_int_distribution<size_t> label_dist(1, max_label);
+    uniform_int_distribution<int> char_dist('a', max_char);
+
+    vector<string> domains(count);
+    for (auto &domain : domains)
+    {
+        for (size_t labels = labels_dist(gen); labels > 0; --labels)
+        {
+            for (size_t length = label_dist(gen); length > 0; --length)
+            {
+                domain += static_cast<char>(char_dist(gen));
+            }
+            if (labels > 1)
+            {
+                domain += '.';
+            }
+        }
+    }
+
+    return domains;
+}
+
+// Проверка перебором всех надоменов
+bool DomainBannedNaive(const string &domain, const vector<string> &banned)
+{
+    for (size_t i = 0; i < domain.size(); ++i)
+    {
+        if ((i == 0 || domain[i - 1] == '.')
+            && find(banned.begin(), banned.end(), domain.substr(i)) != banned.end())
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void TestDomainTrieMatchesNaive()
+{
+    mt19937 gen(17);
+
+    for (int round = 0; round < 20; ++round)
+    {
+        auto banned = RandomDomains(50 + round * 10, gen);
+        const DomainTrie trie(banned);
+        SortByReversed(banned);
+
+        for (const auto &domain : RandomDomains(2000, gen, 6))
+        {
+            const bool expected = DomainBannedNaive(domain, banned);
+            ASSERT_EQUAL(DomainBanned(domain, trie), expected);
+            ASSERT_EQUAL(DomainBanned(domain, banned), expected);
+        }
+    }
+}
+
+void TestDynamicDomainFilter()
+{
+    mt19937 gen(23);
+    auto initial = RandomDomains(3000, gen);
+    vector<string> banned = initial;
+    DynamicDomainFilter filter(initial);
+
+    const auto pool = RandomDomains(500, gen);
+    const auto queries = RandomDomains(200, gen, 6);
+
+    for (int step = 0; step < 5000; ++step)
+    {
+        const string &domain = pool[gen() % pool.size()];
+
+        if (gen() % 2)
+        {
+            filter.Add(domain);
+            banned.push_back(domain);
+        }
+        else
+        {
+            filter.Remove(domain);
+            banned.erase(remove(banned.begin(), banned.end(), domain), banned.end());
+        }
+
+        if (step % 500 == 0 || step == 4999)
+        {
+            for (const auto &query : queries)
+            {
+                ASSERT_EQUAL(filter.Banned(query), DomainBannedNaive(query, banned));
+            }
+        }
+    }
+
+    filter.Merge();
+    ASSERT_EQUAL(filter.PendingChanges(), 0u);
+    for (const auto &query : queries)
+    {
+        ASSERT_EQUAL(filter.Banned(query), DomainBannedNaive(query, banned));
+    }
+}
+
+void TestStreamCycle()
+{
+    stringstream in("2\nya.ru\ncom\n? m.ya.ru\n? maps.me\n+ maps.me\n? m.maps.me\n- com\n? ya.com\n- ya.ru\n+ m.ya.ru\n? ya.ru\n? x.m.ya.ru\n+ ya.ru\n? ya.ru\n"), out;
+    streamCycle(in, out);
+    ASSERT_EQUAL(out.str(), "Bad\nGood\nBad\nGood\nGood\nBad\nBad\n");
+}
+
+void TestDomainBloom()
+{
+    mt19937 gen(41);
+    auto banned = RandomDomains(2000, gen);
+    const DomainTrie trie(banned);
+    const DomainBloom bloom(banned, 0.01);
+
+    for (const auto &domain : RandomDomains(20000, gen, 6))
+    {
+        ASSERT_EQUAL(DomainBanned(domain, trie, bloom), DomainBannedNaive(domain, banned));
+    }
+
+    // Однометочные домены из другого алфавита заведомо чисты, и каждый
+    // проверяется одним ключом, так что доля «может быть» — это доля
+    // ложных срабатываний
+    const auto large = RandomDomains(100000, gen, 3, 8, 'm');
+    for (double rate : {0.05, 0.01, 0.001})
+    {
+        const DomainBloom filter(large, rate);
+        size_t false_positives = 0;
+        const size_t probes = 100000;
+
+        for (size_t i = 0; i < probes; ++i)
+        {
+            string domain(10, 'n');
+            for (char &c : domain)
+            {
+                c = 'n' + gen() % 13;
+            }
+            false_positives += filter.MayBeBanned(domain);
+        }
+
+        ASSERT(false_positives < 2 * rate * probes + 10);
+    }
+}
+
+void TestTrieSaveLoad()
+{
+    mt19937 gen(31);
+    auto banned = RandomDomains(3000, gen);
+    banned.push_back("");
+    const string path = (filesystem::temp_directory_path() / "domains_test.trie").string();
+    DomainTrie(banned).Save(path);
+
+    const DomainTrie loaded = DomainTrie::Load(path);
+    SortByReversed(banned);
+    for (const auto &domain : RandomDomains(5000, gen, 6))
+    {
+        ASSERT_EQUAL(DomainBanned(domain, loaded), DomainBannedNaive(domain, banned));
+    }
+
+    DomainTrie moved = DomainTrie::Load(path);
+    moved = DomainTrie::Load(path);
+    ASSERT_EQUAL(moved.NodeCount(), loaded.NodeCount());
+    ASSERT_EQUAL(DomainBanned(banned.back(), moved), true);
+
+    DomainTrie().Save(path);
+    ASSERT_EQUAL(DomainBanned("ya.ru", DomainTrie::Load(path)), false);
+
+    auto assertCorrupted = [&path]
+    {
+        try
+        {
+            DomainTrie::Load(path);
+            ASSERT(false);
+        }
+        catch (runtime_error &)
+        {
+        }
+    };
+
+    {
+        ofstream out(path, ios::binary | ios::app);
+        out << "x";
+    }
+    assertCorrupted();
+
+    // Порча полей вершин: заголовок из 24 байт, затем вершины
+    // {firstChild, labelOffset, labelLength, childCount, terminal}
+    DomainTrie(vector<string>{"ya.ru", "maps.me"}).Save(path);
+    string original;
+    {
+        ifstream in(path, ios::binary);
+        original.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+
+    uint64_t nodeCount, labelSize;
+    memcpy(&nodeCount, original.data() + 8, sizeof(nodeCount));
+    memcpy(&labelSize, original.data() + 16, sizeof(labelSize));
+    const size_t nodeSize = (original.size() - 24 - labelSize) / nodeCount - 1;
+
+    auto patch = [&](size_t node, size_t offset, auto value)
+    {
+        string data = original;
+        memcpy(&data[24 + node * nodeSize + offset], &value, sizeof(value));
+        ofstream(path, ios::binary | ios::trunc) << data;
+    };
+
+    patch(0, 0, numeric_limits<uint32_t>::max());
+    assertCorrupted();
+    patch(1, 4, numeric_limits<uint32_t>::max());
+    assertCorrupted();
+    patch(0, 0, uint32_t(0));
+    assertCorrupted();
+    patch(1, 14, uint8_t(2));
+    assertCorrupted();
+    patch(1, 14, uint8_t(1));
+    ASSERT_EQUAL(DomainTrie::Load(path).NodeCount(), nodeCount);
+
+    remove(path.c_str());
+}
+
+void TestDomainGenerator()
+{
+    const WorkloadConfig config{"test", 5000, 20000, 0.3, 0.5, 4, 7};
+
+    DomainGenerator gen(config.seed);
+    const auto banned = gen.Banned(config);
+    const auto queries = gen.Queries(config, banned);
+    ASSERT_EQUAL(DomainGenerator(config.seed).Banned(config), banned);
+
+    for (const auto &domain : banned)
+    {
+        ASSERT(!domain.empty() && domain.front() != '.' && domain.back() != '.');
+        ASSERT(domain.find("..") == string::npos);
+        ASSERT(domain.find("-.") == string::npos && domain.find(".-") == string::npos);
+    }
+
+    // Попадания по построению плюс редкие случайные совпадения
+    const DomainTrie trie(banned);
+    size_t hits = 0;
+    for (const auto &domain : queries)
+    {
+        hits += DomainBanned(domain, trie);
+    }
+    ASSERT(hits >= 0.27 * queries.size() && hits <= 0.4 * queries.size());
+
+    stringstream input;
+    DomainGenerator(config.seed).WriteInput(config, input);
+    stringstream out;
+    mainCycle(input, out, 2);
+    const string verdicts = out.str();
+    ASSERT_EQUAL(count(verdicts.begin(), verdicts.end(), 'B'), static_cast<ptrdiff_t>(hits));
+}
+
+void TestMainCycle()
+{
+    {
+        const string banned = "3\nb.ru\nc.ru\nd\n";
+        string queries = "1000\n";
+        string expected;
+        for (int i = 0; i < 1000; ++i)
+        {
+            const string domain = string(1, 'a' + i % 5) + (i % 3 ? ".ru" : ".d");
+            queries += domain + "\n";
+            expected += domain == "b.ru" || domain == "c.ru" || i % 3 == 0 ? "Bad\n" : "Good\n";
+        }
+
+        for (size_t threads : {0, 1, 3})
+        {
+            for (size_t batch : {0, 1, 7, 1000, 5000})
+            {
+                stringstream in(banned + queries), out;
+                mainCycle(in, out, threads, batch);
+                ASSERT_EQUAL(out.str(), expected);
+            }
+        }
+
+        stringstream in(banned + queries), out;
+        mainCycle(in, out, 2, 100, 0.01);
+        ASSERT_EQUAL(out.str(), expected);
+    }
+
+    stringstream in("4\nya.ru\nmaps.me\nm.ya.ru\ncom\n7\nya.ru\nya.com\nm.maps.me\nmoscow.m.ya.ru\nmaps.com\nmaps.ru\nya.ya\n"), out;
+    mainCycle(in, out);
+    ASSERT_EQUAL(out.str(), "Bad\nBad\nBad\nBad\nBad\nGood\nGood\n");
+    out = stringstream("");
+    in = stringstream("0\n7\nya.ru\nya.com\nm.maps.me\nmoscow.m.ya.ru\nmaps.com\nmaps.ru\nya.ya\n");
+    mainCycle(in, out);
+    ASSERT_EQUAL(out.str(), "Good\nGood\nGood\nGood\nGood\nGood\nGood\n");
+    out = stringstream("");
+    in = stringstream("0\n0");
+    mainCycle(in, out);
+    ASSERT_EQUAL(out.str(), "");
+
+    // Доменов меньше объявленного: проверяются только прочитанные,
+    // без доменов, оставшихся в строках от прошлых пакетов
+    out = stringstream("");
+    in = stringstream("1\nb.ru\n7\nb.ru\nc.ru\na.ru\na.ru\nb.ru\n");
+    mainCycle(in, out, 2, 2);
+    ASSERT_EQUAL(out.str(), "Bad\nGood\nGood\nGood\nBad\n");
+}
+
+// Запускается с ключом --benchmark, чтобы не задерживать обычную фильтрацию
+void BenchmarkDomainBanned()
+{
+    mt19937 gen(42);
+    auto banned = RandomDomains(1000000, gen, 4, 6, 'z');
+    const auto queries = RandomDomains(10000000, gen, 5, 6, 'z');
+
+    DomainTrie trie;
+    {
+        LOG_DURATION("DomainTrie build, 1M banned");
+        trie = DomainTrie(banned);
+    }
+    cerr << "DomainTrie nodes: " << trie.NodeCount() << ", bytes: " << trie.MemoryUsage() << endl;
+    {
+        auto copy = banned;
+        LOG_DURATION("sort with reversedCmpLess, 1M banned");
+        sort(copy.begin(), copy.end(), reversedCmpLess);
+    }
+    {
+        // Домены под общими длинными суффиксами, как у хостингов и CDN
+        auto copy = banned;
+        for (size_t i = 0; i < copy.size(); ++i)
+        {
+            copy[i] += i % 2 ? ".users.cdn-provider.example.com" : ".static.hosting.example.net";
+        }
+        auto fast = copy;
+        {
+            LOG_DURATION("sort with reversedCmpLess, 1M banned with shared suffixes");
+            sort(copy.begin(), copy.end(), reversedCmpLess);
+        }
+        {
+            LOG_DURATION("SortByReversed, 1M banned with shared suffixes");
+            SortByReversed(fast);
+        }
+        ASSERT(copy == fast);
+    }
+    {
+        LOG_DURATION("SortByReversed, 1M banned");
+        SortByReversed(banned);
+    }
+
+    size_t trie_hits = 0;
+    {
+        LOG_DURATION("DomainTrie, 10M queries");
+        for (const auto &domain : queries)
+        {
+            trie_hits += DomainBanned(domain, trie);
+        }
+    }
+    size_t vector_hits = 0;
+    {
+        LOG_DURATION("Sorted vector, 10M queries");
+        for (const auto &domain : queries)
+        {
+            vector_hits += DomainBanned(domain, banned);
+        }
+    }
+    ASSERT_EQUAL(trie_hits, vector_hits);
+    cerr << "Banned: " << trie_hits << " of " << queries.size() << endl;
+
+    string input = to_string(banned.size()) + "\n";
+    for (const auto &domain : banned)
+    {
+        input += domain + "\n";
+    }
+    input += to_string(queries.size()) + "\n";
+    for (const auto &domain : queries)
+    {
+        input += domain + "\n";
+    }
+
+    for (size_t threads : {1, 4})
+    {
+        istringstream in(input);
+        ostringstream out;
+        LOG_DURATION("mainCycle, 1M banned, 10M queries, " + to_string(threads) + " threads");
+        mainCycle(in, out, threads);
+    }
+
+    // Изменения списка вперемешку с проверками: 300K изменений и 3M проверок
+    DynamicDomainFilter filter(banned);
+    size_t max_change = 0;
+    {
+        LOG_DURATION("DynamicDomainFilter, 300K changes and 3M queries");
+        for (size_t i = 0; i < 300000; ++i)
+        {
+            const auto start = chrono::steady_clock::now();
+            if (i % 2)
+            {
+                filter.Remove(banned[i * 7 % banned.size()]);
+            }
+            else
+            {
+                filter.Add(queries[i]);
+            }
+            max_change = max<size_t>(max_change, chrono::duration_cast<chrono::milliseconds>(
+                chrono::steady_clock::now() - start).count());
+
+            for (size_t j = 0; j < 10; ++j)
+            {
+                filter.Banned(queries[i * 10 + j]);
+            }
+        }
+    }
+    cerr << "Slowest change (includes merges): " << max_change << " ms" << endl;
+
+    // Чистый поток: 99% доменов в зоне, которой нет среди запрещённых
+    vector<string> clean = RandomDomains(10000000, gen, 3, 10, 'z');
+    for (size_t i = 0; i < clean.size(); ++i)
+    {
+        clean[i] = i % 100 ? clean[i] + ".clean-zone" : "www." + banned[i % banned.size()];
+    }
+
+    size_t clean_hits = 0;
+    {
+        LOG_DURATION("DomainTrie, 10M mostly clean queries");
+        for (const auto &domain : clean)
+        {
+            clean_hits += DomainBanned(domain, trie);
+        }
+    }
+    for (double rate : {0.01, 0.001})
+    {
+        DomainBloom bloom(banned, rate);
+        cerr << "DomainBloom with p = " << rate << ": " << bloom.MemoryUsage() << " bytes, "
+             << bloom.HashCount() << " hashes" << endl;
+
+        size_t passed = 0;
+        size_t hits = 0;
+        {
+            LOG_DURATION("DomainBloom + DomainTrie, 10M mostly clean queries");
+            for (const auto &domain : clean)
+            {
+                const bool maybe = bloom.MayBeBanned(domain);
+                passed += maybe;
+                hits += maybe && trie.Banned(domain);
+            }
+        }
+        ASSERT_EQUAL(hits, clean_hits);
+        cerr << "Passed to trie: " << passed << ", banned: " << hits << endl;
+    }
+
+    // Чистые домены под тем же длинным суффиксом, что и запрещённые:
+    // дерево проходит суффикс и отсеивает домен только в глубине
+    {
+        const string zone = ".users.cdn-provider.example.com";
+        vector<string> zoned = RandomDomains(1000000, gen, 2, 6, 'z');
+        for (auto &domain : zoned)
+        {
+            domain += zone;
+        }
+        const DomainTrie zoned_trie(zoned);
+        const DomainBloom zoned_bloom(zoned, 0.01);
+
+        vector<string> zoned_queries = RandomDomains(10000000, gen, 3, 10, 'z');
+        for (auto &domain : zoned_queries)
+        {
+            domain += zone;
+        }
+
+        size_t trie_only = 0;
+        size_t with_bloom = 0;
+        {
+            LOG_DURATION("DomainTrie, 10M queries under a shared suffix");
+            for (const auto &domain : zoned_queries)
+            {
+                trie_only += DomainBanned(domain, zoned_trie);
+            }
+        }
+        {
+            LOG_DURATION("DomainBloom + DomainTrie, 10M queries under a shared suffix");
+            for (const auto &domain : zoned_queries)
+            {
+                with_bloom += DomainBanned(domain, zoned_trie, zoned_bloom);
+            }
+        }
+        ASSERT_EQUAL(trie_only, with_bloom);
+        cerr << "Banned: " << trie_only << endl;
+    }
+
+    const string path = (filesystem::temp_directory_path() / "domains_benchmark.trie").string();
+    trie.Save(path);
+    {
+        LOG_DURATION("Start from text: ReadDomains and DomainTrie build, 1M banned");
+        istringstream in(input);
+        DomainTrie(ReadDomains(in));
+    }
+    {
+        LOG_DURATION("Start from file: DomainTrie::Load, 1M banned");
+        DomainTrie::Load(path);
+    }
+    remove(path.c_str());
+}
+
+// Прогоняет одну синтетическую нагрузку: время и запросы в секунду при
+// проверке всех запросов деревом, деревом с фильтром Блума и полным
+// mainCycle, рядом с памятью структур. Ответы mainCycle сверяются с деревом.
+void RunWorkload(const WorkloadConfig &config)
+{
+    DomainGenerator gen(config.seed);
+    const auto banned = gen.Banned(config);
+    const auto queries = gen.Queries(config, banned);
+    const string total = to_string(queries.size()) + " queries";
+
+    cerr << "--- " << config.name << ": " << banned.size() << " banned, " << queries.size()
+         << " queries, hit ratio " << config.hit_ratio << ", shared zones " << config.shared_zone_ratio
+         << ", depth up to " << config.max_depth << endl;
+
+    const DomainTrie trie(banned);
+    const DomainBloom bloom(banned, 0.01);
+    cerr << "DomainTrie: " << trie.NodeCount() << " nodes, " << trie.MemoryUsage() << " bytes; DomainBloom: "
+         << bloom.MemoryUsage() << " bytes" << endl;
+
+    // Проход печатается через LOG_DURATION, а его длительность в секундах
+    // возвращается для пересчёта в запросы в секунду
+    const auto timed = [](const string &name, auto &&body)
+    {
+        const auto start = chrono::steady_clock::now();
+        {
+            LOG_DURATION(name);
+            body();
+        }
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+    const auto perSecond = [&queries](double seconds)
+    {
+        return static_cast<size_t>(queries.size() / seconds);
+    };
+
+    size_t trie_hits = 0;
+    const double trie_seconds = timed("DomainTrie, " + total, [&]
+    {
+        for (const auto &domain : queries)
+        {
+            trie_hits += DomainBanned(domain, trie);
+        }
+    });
+    size_t bloom_hits = 0;
+    const double bloom_seconds = timed("DomainBloom + DomainTrie, " + total, [&]
+    {
+        for (const auto &domain : queries)
+        {
+            bloom_hits += DomainBanned(domain, trie, bloom);
+        }
+    });
+    cerr << "Banned " << trie_hits << " (" << 100.0 * trie_hits / queries.size() << "%)" << endl;
+    ASSERT_EQUAL(trie_hits, bloom_hits);
+    cerr << config.name << ", DomainTrie: " << perSecond(trie_seconds) << " queries/s, "
+         << trie.MemoryUsage() << " bytes" << endl;
+    cerr << config.name << ", DomainBloom + DomainTrie: " << perSecond(bloom_seconds) << " queries/s, "
+         << trie.MemoryUsage() + bloom.MemoryUsage() << " bytes" << endl;
+
+    stringstream input;
+    DomainGenerator(config.seed).WriteInput(config, input);
+    const string text = input.str();
+    for (size_t threads : {1, 4})
+    {
+        istringstream in(text);
+        ostringstream out;
+        const double seconds = timed("mainCycle, " + to_string(threads) + " threads, " + total
+                                     + " including parsing and build", [&]
+        {
+            mainCycle(in, out, threads);
+        });
+        cerr << config.name << ", mainCycle, " << threads << " threads: " << perSecond(seconds)
+             << " queries/s including parsing and build" << endl;
+
+        // Ответы — только "Bad" и "Good", по одному на строку
+        const string verdicts = out.str();
+        ASSERT_EQUAL(count(verdicts.begin(), verdicts.end(), '\n'), static_cast<ptrdiff_t>(queries.size()));
+        ASSERT_EQUAL(count(verdicts.begin(), verdicts.end(), 'B'), static_cast<ptrdiff_t>(trie_hits));
+    }
+}
+
+// Нагрузки, близкие к реальным спискам блокировок
+const vector<WorkloadConfig> &WorkloadProfiles()
+{
+    static const vector<WorkloadConfig> profiles = {
+        {"clean-traffic", 1000000, 5000000, 0.01, 0.1, 3, 1},
+        {"shared-zones", 1000000, 5000000, 0.1, 0.8, 3, 2},
+        {"deep-domains", 500000, 5000000, 0.1, 0.3, 8, 3},
+        {"mostly-banned", 1000000, 5000000, 0.9, 0.3, 3, 4},
+    };
+
+    return profiles;
+}
+
+// Запускается с ключом --workload профиль|all [глубина [доля_общих_зон]],
+// глубина и доля общих зон заменяют значения профиля
+int BenchmarkWorkloads(int argc, char *argv[])
+{
+    const string_view name = argv[2];
+    bool found = false;
+
+    for (WorkloadConfig config : WorkloadProfiles())
+    {
+        if (name != "all" && name != config.name)
+        {
+            continue;
+        }
+
+        if (argc > 3)
+        {
+            config.max_depth = stoul(argv[3]);
+        }
+        if (argc > 4)
+        {
+            config.shared_zone_ratio = stod(argv[4]);
+        }
+
+        RunWorkload(config);
+        found = true;
+    }
+
+    if (!found)
+    {
+        cerr << "Unknown workload " << name << ", expected all or one of:";
+        for (const auto &config : WorkloadProfiles())
+        {
+            cerr << ' ' << config.name;
+        }
+        cerr << endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+void PrintUsage(ostream &out)
+{
+    out << "Usage: domains [mode]\n"
+        << "  (no mode)        read banned and checked domains from stdin, print Good or Bad\n"
+        << "  --stream         after the banned list, read \"? domain\", \"+ domain\" and \"- domain\" commands\n"
+        << "  --compile FILE   read banned domains from stdin and save the trie to FILE\n"
+        << "  --banned FILE    load the trie from FILE and read only checked domains\n"
+        << "  --bloom RATE     put a Bloom filter with false positive RATE before the trie.\n"
+        << "                   Helps when banned domains share long suffixes (hosting, CDN zones)\n"
+        << "                   and the trie has to walk deep. On clean traffic the top of the\n"
+        << "                   trie stays in cache and the filter can double the check time;\n"
+        << "                   compare both with --workload on a similar profile first.\n"
+        << "  --generate BANNED QUERIES HIT_RATIO [SEED [DEPTH [SHARED_ZONES]]]\n"
+        << "                   print a synthetic input\n"
+        << "  --benchmark      run the benchmarks\n"
+        << "  --workload NAME|all [DEPTH [SHARED_ZONES]]\n"
+        << "                   run synthetic workload profiles\n"
+        << "  --help           print this message\n";
+}
+
+int main(int argc, char *argv[])
+{
+    {
+        TestRunner tr;
+        RUN_TEST(tr,TestSortByReversed);
+        RUN_TEST(tr,TestReversedCmpLessFast);
+        RUN_TEST(tr,TestDomainBanned);
+        RUN_TEST(tr,TestDomainTrie);
+        RUN_TEST(tr,TestDomainTrieMatchesNaive);
+        RUN_TEST(tr,TestDynamicDomainFilter);
+        RUN_TEST(tr,TestStreamCycle);
+        RUN_TEST(tr,TestTrieSaveLoad);
+        RUN_TEST(tr,TestDomainBloom);
+        RUN_TEST(tr,TestDomainGenerator);
+        RUN_TEST(tr,TestMainCycle);
+    }
+
+    if (argc > 1 && string_view(argv[1]) == "--help")
+    {
+        PrintUsage(cout);
+        return 0;
+    }
+
+    if (argc > 1 && string_view(argv[1]) == "--benchmark")
+    {
+        BenchmarkDomainBanned();
+        return 0;
+    }
+
+    if (argc > 2 && string_view(argv[1]) == "--workload")
+    {
+        return BenchmarkWorkloads(argc, argv);
+    }
+
+    if (argc > 1 && string_view(argv[1]) == "--stream")
+    {
+        streamCycle(cin, cout);
+        return 0;
+    }
+
+    // --generate запреты запросы доля_попаданий [seed [глубина [доля_общих_зон]]]:
+    // печатает синтетический вход для mainCycle
+    if (argc > 4 && string_view(argv[1]) == "--generate")
+    {
+        const WorkloadConfig config{"generated", stoul(argv[2]), stoul(argv[3]), stod(argv[4]),
+                                    argc > 7 ? stod(argv[7]) : 0.3,
+                                    argc > 6 ? stoul(argv[6]) : 4,
+                                    argc > 5 ? static_cast<uint32_t>(stoul(argv[5])) : 1};
+        DomainGenerator(config.seed).WriteInput(config, cout);
+        return 0;
+    }
+
+    // --compile файл: читает список запретов и сохраняет дерево в файл,
+    // --banned файл: берёт запреты из файла и читает только проверяемые домены
+    if (argc > 2 && string_view(argv[1]) == "--compile")
+    {
+        DomainTrie(ReadDomains(cin)).Save(argv[2]);
+        return 0;
+    }
+
+    // --bloom доля: фильтр Блума с заданной долей ложных срабатываний
+    if (argc > 2 && string_view(argv[1]) == "--bloom")
+    {
+        mainCycle(cin, cout, max(1u, thread::hardware_concurrency()), 1 << 16, stod(argv[2]));
+        return 0;
+    }
+
+    if (argc > 2 && string_view(argv[1]) == "--banned")
+    {
+        checkDomains(cin, cout, DomainTrie::Load(argv[2]));
+        return 0;
     }
 
     mainCycle(cin, cout);
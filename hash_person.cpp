@@ -1,4 +1,5 @@
 #include "test_runner.h"
+#include "hash_utils.h"
 #include <limits>
 #include <random>
 #include <unordered_set>
@@ -6,20 +7,6 @@
 
 using namespace std;
 
-static size_t getPolynominalHash(const vector<size_t> hashes, size_t coeff)
-{
-    size_t result = 0;
-    size_t multiplier = 1;
-
-    for (const auto &i : hashes)
-    {
-        result += i * multiplier;
-        multiplier *= coeff;
-    }
-
-    return result;
-}
-
 struct Address
 {
     string city, street;
@@ -53,26 +40,25 @@ struct AddressHasher
 {
     size_t operator()(const Address &a) const
     {
-        return getPolynominalHash({shash(a.city), shash(a.street), ihash(a.building)},
-            2002997);
+        return HashValues(a.city, a.street, a.building);
     }
-
-    hash<string> shash;
-    hash<int> ihash;
 };
 
+// Адрес хешируется как поле Person тем же способом, что и стандартные типы
+namespace std
+{
+    template <>
+    struct hash<Address> : AddressHasher
+    {
+    };
+}
+
 struct PersonHasher
 {
     size_t operator()(const Person &p) const
     {
-        return getPolynominalHash({shash(p.name), ihash(p.height), dhash(p.weight), ahash(p.address)},
-            2005343);
+        return HashValues(p.name, p.height, p.weight, p.address);
     }
-
-    AddressHasher ahash;
-    hash<string> shash;
-    hash<double> dhash;
-    hash<int> ihash;
 };
 
 // сгенерированы командой:
@@ -193,12 +179,45 @@ void TestDistribution()
     ASSERT(pearson_stat < critical_value);
 }
 
+// Различные люди не должны давать совпадающих 64-битных хешей:
+// среди ~10^5 значений вероятность случайной коллизии ~10^-9
+void TestCollisions()
+{
+    mt19937 gen(42);
+    uniform_int_distribution<int> height_dist(150, 200);
+    uniform_int_distribution<int> building_dist(1, 300);
+    uniform_int_distribution<int> word_dist(0, WORDS.size() - 1);
+
+    PersonHasher hasher;
+    unordered_set<Person, PersonHasher> persons;
+    unordered_set<size_t> hashes;
+
+    for (size_t t = 0; t < 100000; ++t)
+    {
+        Person person;
+        person.name = WORDS[word_dist(gen)];
+        person.height = height_dist(gen);
+        person.weight = 70;
+        person.address.city = "London";
+        person.address.street = WORDS[word_dist(gen)];
+        person.address.building = building_dist(gen);
+
+        if (persons.insert(person).second)
+        {
+            hashes.insert(hasher(person));
+        }
+    }
+
+    ASSERT_EQUAL(hashes.size(), persons.size());
+}
+
 int main()
 {
     TestRunner tr;
     RUN_TEST(tr, TestSmoke);
     RUN_TEST(tr, TestPurity);
     RUN_TEST(tr, TestDistribution);
+    RUN_TEST(tr, TestCollisions);
 
     return 0;
 }
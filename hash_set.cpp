@@ -1,12 +1,55 @@
 #include "test_runner.h"
+#include "profile.h"
+#include "hash_utils.h"
 
+#include <atomic>
 #include <forward_list>
+#include <future>
+#include <mutex>
+#include <unordered_map>
 #include <iterator>
 #include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <type_traits>
+#include <unordered_set>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
-template <typename Type, typename Hasher>
+struct HashSetStats
+{
+    size_t size;
+    size_t bucket_count;
+    size_t empty_buckets;
+    size_t max_chain;
+    double avg_chain;  // по непустым бакетам
+    double load_factor;
+};
+
+ostream &operator<<(ostream &os, const HashSetStats &stats)
+{
+    return os << "size " << stats.size
+              << ", buckets " << stats.bucket_count
+              << ", empty " << stats.empty_buckets
+              << ", max chain " << stats.max_chain
+              << ", avg chain " << stats.avg_chain
+              << ", load factor " << stats.load_factor;
+}
+
+// При PowerOfTwo число бакетов — степень двойки, а бакет выбирается
+// по младшим битам перемешанного хеша. Иначе используются простые числа
+// бакетов и остаток от деления, как в unordered_set GCC и Clang.
+template <typename Type, typename Hasher, bool PowerOfTwo = false>
 class HashSet
 {
 public:
@@ -15,52 +58,812 @@ public:
 public:
     explicit HashSet(size_t num_buckets, const Hasher &hasher = {}) : _hasher(hasher)
     {
-        _storage.resize(num_buckets);
+        _storage.resize(PowerOfTwo ? roundUpToPowerOfTwo(num_buckets) : max<size_t>(num_buckets, 1));
+    }
+
+    void Add(const Type &value)
+    {
+        BucketList &bucket = getBucket(value);
+
+        if (!found(value, bucket))
+        {
+            bucket.push_front(value);
+            ++_size;
+
+            if (_size > _maxLoadFactor * _storage.size())
+            {
+                rehash(PowerOfTwo ? _storage.size() * 2 : nextPrime(_storage.size() * 2));
+            }
+        }
+    }
+
+    bool Has(const Type &value) const
+    {
+        return found(value, getBucket(value));
+    }
+
+    void Erase(const Type &value)
+    {
+        BucketList &bucket = getBucket(value);
+
+        for (auto prev = bucket.before_begin(), it = bucket.begin(); it != bucket.end(); prev = it++)
+        {
+            if (*it == value)
+            {
+                bucket.erase_after(prev);
+                --_size;
+                return;
+            }
+        }
+    }
+
+    const BucketList &GetBucket(const Type &value) const
+    {
+        return getBucket(value);
+    }
+
+    size_t Size() const
+    {
+        return _size;
+    }
+
+    size_t BucketCount() const
+    {
+        return _storage.size();
+    }
+
+    void SetMaxLoadFactor(double max_load_factor)
+    {
+        _maxLoadFactor = max_load_factor;
+    }
+
+    HashSetStats Stats() const
+    {
+        HashSetStats stats = {_size, _storage.size(), 0, 0, 0, 0};
+
+        for (const auto &bucket : _storage)
+        {
+            const size_t chain = distance(bucket.begin(), bucket.end());
+            stats.max_chain = max(stats.max_chain, chain);
+            stats.empty_buckets += chain == 0;
+        }
+
+        const size_t used_buckets = stats.bucket_count - stats.empty_buckets;
+        stats.avg_chain = used_buckets ? static_cast<double>(_size) / used_buckets : 0;
+        stats.load_factor = static_cast<double>(_size) / stats.bucket_count;
+        return stats;
+    }
+
+private:
+    vector<BucketList> _storage;
+    const Hasher _hasher;
+    size_t _size = 0;
+    double _maxLoadFactor = 1.0;
+
+    static size_t roundUpToPowerOfTwo(size_t value)
+    {
+        size_t result = 1;
+
+        while (result < value)
+        {
+            result *= 2;
+        }
+
+        return result;
+    }
+
+    static size_t nextPrime(size_t value)
+    {
+        auto isPrime = [](size_t n)
+        {
+            for (size_t d = 2; d * d <= n; ++d)
+            {
+                if (n % d == 0)
+                {
+                    return false;
+                }
+            }
+
+            return n > 1;
+        };
+
+        while (!isPrime(value))
+        {
+            ++value;
+        }
+
+        return value;
+    }
+
+    size_t bucketIndex(const Type &value, size_t bucket_count) const
+    {
+        if constexpr (PowerOfTwo)
+        {
+            return MixHash(_hasher(value)) & (bucket_count - 1);
+        }
+        else
+        {
+            return _hasher(value) % bucket_count;
+        }
+    }
+
+    BucketList &getBucket(const Type &value)
+    {
+        return _storage[bucketIndex(value, _storage.size())];
+    }
+
+    const BucketList &getBucket(const Type &value) const
+    {
+        return _storage[bucketIndex(value, _storage.size())];
+    }
+
+    bool found(const Type &value, const BucketList &bucket) const
+    {
+        auto result = find(bucket.begin(), bucket.end(), value) != bucket.end();
+        return result;
+    }
+
+    // Узлы переносятся в новые бакеты через splice_after без выделений памяти
+    void rehash(size_t bucket_count)
+    {
+        vector<BucketList> storage(bucket_count);
+
+        for (auto &bucket : _storage)
+        {
+            while (!bucket.empty())
+            {
+                auto &target = storage[bucketIndex(bucket.front(), bucket_count)];
+                target.splice_after(target.before_begin(), bucket, bucket.before_begin());
+            }
+        }
+
+        _storage = move(storage);
+    }
+};
+
+// Хеш-множество с открытой адресацией в стиле Swiss table. Для каждой
+// ячейки хранится управляющий байт: пусто, удалено или 7 младших бит хеша.
+// Ячейки сгруппированы по 16, и поиск сравнивает байты целой группы одной
+// SSE2-инструкцией, обращаясь к самим значениям только при совпадении.
+// Таблица растёт, когда занято больше 7/8 ячеек (с учётом удалённых).
+template <typename Type, typename Hasher>
+class FlatHashSet
+{
+public:
+    explicit FlatHashSet(size_t expected_size = 0, const Hasher &hasher = {}) : _hasher(hasher)
+    {
+        size_t capacity = GROUP_SIZE;
+
+        while (capacity * 7 / 8 < expected_size)
+        {
+            capacity *= 2;
+        }
+
+        reset(capacity);
+    }
+
+    FlatHashSet(const FlatHashSet &) = delete;
+    FlatHashSet &operator=(const FlatHashSet &) = delete;
+
+    ~FlatHashSet()
+    {
+        destroyAll();
+    }
+
+    void Add(const Type &value)
+    {
+        const size_t hash = mix(_hasher(value));
+
+        if (find(value, hash) != NOT_FOUND)
+        {
+            return;
+        }
+
+        if ((_size + _deleted + 1) * 8 > _capacity * 7)
+        {
+            rehash(_size * 2 >= _capacity ? _capacity * 2 : _capacity);
+        }
+
+        insertUnique(value, hash);
+    }
+
+    bool Has(const Type &value) const
+    {
+        return find(value, mix(_hasher(value))) != NOT_FOUND;
+    }
+
+    void Erase(const Type &value)
+    {
+        const size_t index = find(value, mix(_hasher(value)));
+
+        if (index == NOT_FOUND)
+        {
+            return;
+        }
+
+        slot(index)->~Type();
+        --_size;
+
+        // Если в группе есть пустая ячейка, ни одна цепочка проб не проходила
+        // через неё дальше, и метка удаления не нужна
+        if (matchEmpty(index & ~(GROUP_SIZE - 1)))
+        {
+            _ctrl[index] = EMPTY;
+        }
+        else
+        {
+            _ctrl[index] = DELETED;
+            ++_deleted;
+        }
+    }
+
+    size_t Size() const
+    {
+        return _size;
+    }
+
+    size_t Capacity() const
+    {
+        return _capacity;
     }
 
-    void Add(const Type &value)
+private:
+    static constexpr size_t GROUP_SIZE = 16;
+    static constexpr size_t NOT_FOUND = numeric_limits<size_t>::max();
+    static constexpr int8_t EMPTY = -128;
+    static constexpr int8_t DELETED = -2;
+
+    struct alignas(GROUP_SIZE) Group
+    {
+        int8_t ctrl[GROUP_SIZE];
+    };
+
+    struct Slot
+    {
+        alignas(Type) unsigned char data[sizeof(Type)];
+    };
+
+    const Hasher _hasher;
+    unique_ptr<Group[]> _groups;
+    int8_t *_ctrl = nullptr;
+    unique_ptr<Slot[]> _slots;
+    size_t _capacity = 0;
+    size_t _size = 0;
+    size_t _deleted = 0;
+
+    // Пользовательские хешеры бывают тождественными, как IntHasher,
+    // поэтому хеш перемешивается перед разбиением на номер группы и метку
+    static size_t mix(size_t hash)
+    {
+        return MixHash(hash);
+    }
+
+    static int8_t tag(size_t hash)
+    {
+        return static_cast<int8_t>(hash & 0x7f);
+    }
+
+    Type *slot(size_t index) const
+    {
+        return launder(reinterpret_cast<Type *>(_slots[index].data));
+    }
+
+    // Битовые маски ячеек группы, начинающейся с first
+    uint32_t match(size_t first, int8_t value) const
+    {
+#ifdef __SSE2__
+        const __m128i ctrl = _mm_load_si128(reinterpret_cast<const __m128i *>(_ctrl + first));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+#else
+        uint32_t result = 0;
+        for (size_t i = 0; i < GROUP_SIZE; ++i)
+        {
+            result |= static_cast<uint32_t>(_ctrl[first + i] == value) << i;
+        }
+        return result;
+#endif
+    }
+
+    uint32_t matchEmpty(size_t first) const
+    {
+        return match(first, EMPTY);
+    }
+
+    // Пустые и удалённые ячейки: у обеих меток выставлен старший бит
+    uint32_t matchFree(size_t first) const
+    {
+#ifdef __SSE2__
+        const __m128i ctrl = _mm_load_si128(reinterpret_cast<const __m128i *>(_ctrl + first));
+        return _mm_movemask_epi8(ctrl);
+#else
+        uint32_t result = 0;
+        for (size_t i = 0; i < GROUP_SIZE; ++i)
+        {
+            result |= static_cast<uint32_t>(_ctrl[first + i] < 0) << i;
+        }
+        return result;
+#endif
+    }
+
+    static int lowestBit(uint32_t mask)
+    {
+        return __builtin_ctz(mask);
+    }
+
+    // Квадратичное пробирование по группам: при числе групп, равном
+    // степени двойки, последовательность обходит все группы.
+    // Обход прекращается, как только visit вернёт непустой результат.
+    template <typename Visit>
+    size_t probe(size_t hash, Visit visit) const
+    {
+        const size_t groupMask = _capacity / GROUP_SIZE - 1;
+        size_t group = (hash >> 7) & groupMask;
+
+        for (size_t step = 1; step <= groupMask + 1; ++step)
+        {
+            if (const optional<size_t> result = visit(group * GROUP_SIZE))
+            {
+                return *result;
+            }
+
+            group = (group + step) & groupMask;
+        }
+
+        return NOT_FOUND;
+    }
+
+    size_t find(const Type &value, size_t hash) const
+    {
+        const int8_t h2 = tag(hash);
+
+        return probe(hash, [&](size_t first) -> optional<size_t>
+        {
+            for (uint32_t mask = match(first, h2); mask; mask &= mask - 1)
+            {
+                const size_t index = first + lowestBit(mask);
+
+                if (*slot(index) == value)
+                {
+                    return index;
+                }
+            }
+
+            if (matchEmpty(first))
+            {
+                return NOT_FOUND;
+            }
+
+            return nullopt;
+        });
+    }
+
+    void insertUnique(const Type &value, size_t hash)
+    {
+        const size_t index = probe(hash, [this](size_t first) -> optional<size_t>
+        {
+            if (const uint32_t mask = matchFree(first))
+            {
+                return first + lowestBit(mask);
+            }
+
+            return nullopt;
+        });
+
+        new (_slots[index].data) Type(value);
+
+        if (_ctrl[index] == DELETED)
+        {
+            --_deleted;
+        }
+
+        _ctrl[index] = tag(hash);
+        ++_size;
+    }
+
+    void reset(size_t capacity)
+    {
+        _capacity = capacity;
+        _groups = make_unique<Group[]>(capacity / GROUP_SIZE);
+        _ctrl = _groups[0].ctrl;
+        fill(_ctrl, _ctrl + capacity, EMPTY);
+        _slots = make_unique<Slot[]>(capacity);
+        _size = 0;
+        _deleted = 0;
+    }
+
+    void destroyAll()
+    {
+        for (size_t i = 0; i < _capacity; ++i)
+        {
+            if (_ctrl[i] >= 0)
+            {
+                slot(i)->~Type();
+            }
+        }
+    }
+
+    void rehash(size_t capacity)
+    {
+        auto oldGroups = move(_groups);
+        auto oldSlots = move(_slots);
+        const int8_t *oldCtrl = _ctrl;
+        const size_t oldCapacity = _capacity;
+
+        reset(capacity);
+
+        for (size_t i = 0; i < oldCapacity; ++i)
+        {
+            if (oldCtrl[i] >= 0)
+            {
+                Type *old = launder(reinterpret_cast<Type *>(oldSlots[i].data));
+                insertUnique(*old, mix(_hasher(*old)));
+                old->~Type();
+            }
+        }
+    }
+};
+
+// Множество для сценария «часто читают, редко пишут». Читатели работают
+// с неизменяемой версией таблицы, опубликованной через атомарный указатель.
+// Has не берёт блокировок и не ждёт: он отмечается в счётчике читателей
+// своей полосы для текущей чётности и снимает отметку по окончании.
+// Писатели сериализуются мьютексом, копируют таблицу (неизменённые бакеты
+// разделяются между версиями), публикуют новую версию и освобождают
+// старые, когда ни один читатель не может их держать. Порции AddBatch
+// и EraseBatch копируют таблицу один раз, поэтому заполнение большого
+// множества линейно, а одиночные Add и Erase стоят O(числа бакетов).
+template <typename Type, typename Hasher>
+class ConcurrentHashSet
+{
+public:
+    explicit ConcurrentHashSet(size_t num_buckets = 16, const Hasher &hasher = {})
+        : _hasher(hasher)
+    {
+        size_t bucket_count = 1;
+
+        while (bucket_count < num_buckets)
+        {
+            bucket_count *= 2;
+        }
+
+        _current.store(new Version(bucket_count));
+    }
+
+    ConcurrentHashSet(const ConcurrentHashSet &) = delete;
+    ConcurrentHashSet &operator=(const ConcurrentHashSet &) = delete;
+
+    ~ConcurrentHashSet()
+    {
+        delete _current.load();
+
+        for (const auto &retired : _retired)
+        {
+            delete retired.version;
+        }
+    }
+
+    bool Has(const Type &value) const
+    {
+        atomic<size_t> *active = _readers[readerStripe()].active;
+        const size_t parity = _parity.load();
+        active[parity].fetch_add(1);
+
+        const Version *version = _current.load();
+        const BucketView &bucket = version->views[bucketIndex(value, version->views.size())];
+        const bool result = find(bucket.data, bucket.data + bucket.size, value) != bucket.data + bucket.size;
+
+        active[parity].fetch_sub(1, memory_order_release);
+        return result;
+    }
+
+    void Add(const Type &value)
+    {
+        AddBatch(&value, &value + 1);
+    }
+
+    void Erase(const Type &value)
+    {
+        EraseBatch(&value, &value + 1);
+    }
+
+    // Добавляет все значения диапазона одной новой версией
+    template <typename It>
+    void AddBatch(It first, It last)
+    {
+        lock_guard<mutex> guard(_writeLocker);
+        Draft draft{_current.load(memory_order_relaxed)};
+
+        // Для многопроходных диапазонов таблица растёт сразу до нужного
+        // размера, а не удваивается посреди порции
+        if constexpr (is_base_of_v<forward_iterator_tag, typename iterator_traits<It>::iterator_category>)
+        {
+            const size_t expected = draft.base->size + static_cast<size_t>(distance(first, last));
+            size_t bucket_count = draft.base->buckets.size();
+
+            while (bucket_count < expected)
+            {
+                bucket_count *= 2;
+            }
+
+            if (bucket_count != draft.base->buckets.size())
+            {
+                grow(draft, bucket_count);
+            }
+        }
+
+        for (; first != last; ++first)
+        {
+            const Type &value = *first;
+            const Bucket &bucket = draftBucket(draft, value);
+
+            if (find(bucket.begin(), bucket.end(), value) != bucket.end())
+            {
+                continue;
+            }
+
+            const Version &version = draftVersion(draft);
+
+            if (version.size + 1 > version.buckets.size())
+            {
+                grow(draft, version.buckets.size() * 2);
+            }
+
+            mutableBucket(draft, value).push_back(value);
+            ++draft.next->size;
+        }
+
+        if (draft.next)
+        {
+            publish(draft.next.release());
+        }
+    }
+
+    // Удаляет все значения диапазона одной новой версией
+    template <typename It>
+    void EraseBatch(It first, It last)
+    {
+        lock_guard<mutex> guard(_writeLocker);
+        Draft draft{_current.load(memory_order_relaxed)};
+
+        for (; first != last; ++first)
+        {
+            const Type &value = *first;
+            const Bucket &bucket = draftBucket(draft, value);
+
+            if (find(bucket.begin(), bucket.end(), value) == bucket.end())
+            {
+                continue;
+            }
+
+            Bucket &target = mutableBucket(draft, value);
+            target.erase(find(target.begin(), target.end(), value));
+            --draft.next->size;
+        }
+
+        if (draft.next)
+        {
+            publish(draft.next.release());
+        }
+    }
+
+    size_t Size() const
+    {
+        lock_guard<mutex> guard(_writeLocker);
+        return _current.load(memory_order_relaxed)->size;
+    }
+
+    // Число версий, ещё не освобождённых из-за активных читателей
+    size_t RetiredCount() const
+    {
+        lock_guard<mutex> guard(_writeLocker);
+        return _retired.size();
+    }
+
+private:
+    using Bucket = vector<Type>;
+
+    struct BucketView
+    {
+        const Type *data;
+        size_t size;
+    };
+
+    struct Version
+    {
+        explicit Version(size_t bucket_count)
+        {
+            buckets.reserve(bucket_count);
+
+            for (size_t i = 0; i < bucket_count; ++i)
+            {
+                buckets.push_back(make_shared<Bucket>());
+            }
+
+            fillViews();
+        }
+
+        void fillViews()
+        {
+            views.resize(buckets.size());
+
+            for (size_t i = 0; i < buckets.size(); ++i)
+            {
+                views[i] = {buckets[i]->data(), buckets[i]->size()};
+            }
+        }
+
+        vector<shared_ptr<const Bucket>> buckets;
+        // Плоская копия адресов и размеров бакетов для читателей:
+        // на одну зависимую загрузку меньше, чем через shared_ptr
+        vector<BucketView> views;
+        size_t size = 0;
+    };
+
+    // Черновик следующей версии: таблица копируется при первом изменении
+    // в порции, а каждый бакет — при первом изменении в нём
+    struct Draft
+    {
+        const Version *base;
+        unique_ptr<Version> next;
+        vector<Bucket *> owned;
+    };
+
+    struct Retired
+    {
+        const Version *version;
+        size_t flips;
+    };
+
+    // Число читателей, начавших чтение при чётности 0 и 1. Потоки
+    // распределяются по полосам, каждая в своей кэш-линии.
+    struct alignas(64) ReaderCounters
+    {
+        atomic<size_t> active[2] = {};
+    };
+
+    static constexpr size_t READER_STRIPES = 32;
+
+    const Hasher _hasher;
+    atomic<const Version *> _current;
+    atomic<size_t> _parity{0};
+    mutable array<ReaderCounters, READER_STRIPES> _readers;
+
+    mutable mutex _writeLocker;
+    vector<Retired> _retired;
+    size_t _flips = 0;
+
+    // Полоса назначается потоку при первом чтении; переменная потока
+    // инициализируется константой и не требует проверки инициализации
+    static size_t readerStripe()
     {
-        BucketList &bucket = getBucket(value);
+        static atomic<size_t> counter{0};
+        thread_local size_t stripe = READER_STRIPES;
 
-        if (!found(value, bucket))
+        if (stripe == READER_STRIPES)
         {
-            bucket.push_front(value);
+            stripe = counter.fetch_add(1, memory_order_relaxed) % READER_STRIPES;
         }
+
+        return stripe;
     }
 
-    bool Has(const Type &value) const
+    size_t bucketIndex(const Type &value, size_t bucket_count) const
     {
-        return found(value, getBucket(value));
+        return MixHash(_hasher(value)) & (bucket_count - 1);
     }
 
-    void Erase(const Type &value)
+    static const Version &draftVersion(const Draft &draft)
     {
-        getBucket(value).remove(value);
+        return draft.next ? *draft.next : *draft.base;
     }
 
-    const BucketList &GetBucket(const Type &value) const
+    const Bucket &draftBucket(const Draft &draft, const Type &value) const
     {
-        return getBucket(value);
+        const Version &version = draftVersion(draft);
+        return *version.buckets[bucketIndex(value, version.buckets.size())];
     }
 
-private:
-    vector<BucketList> _storage;
-    const Hasher _hasher;
+    Bucket &mutableBucket(Draft &draft, const Type &value)
+    {
+        if (!draft.next)
+        {
+            draft.next = make_unique<Version>(*draft.base);
+            draft.owned.assign(draft.next->buckets.size(), nullptr);
+        }
 
-    BucketList &getBucket(const Type &value)
+        const size_t index = bucketIndex(value, draft.next->buckets.size());
+
+        if (!draft.owned[index])
+        {
+            auto copy = make_shared<Bucket>(*draft.next->buckets[index]);
+            draft.owned[index] = copy.get();
+            draft.next->buckets[index] = move(copy);
+        }
+
+        return *draft.owned[index];
+    }
+
+    // Перераскладывает черновик по bucket_count новым бакетам,
+    // которые все принадлежат черновику
+    void grow(Draft &draft, size_t bucket_count)
+    {
+        const Version &source = draftVersion(draft);
+        vector<shared_ptr<Bucket>> buckets(bucket_count);
+
+        for (auto &bucket : buckets)
+        {
+            bucket = make_shared<Bucket>();
+        }
+
+        for (const auto &bucket : source.buckets)
+        {
+            for (const auto &item : *bucket)
+            {
+                buckets[bucketIndex(item, bucket_count)]->push_back(item);
+            }
+        }
+
+        auto next = make_unique<Version>(0);
+        next->size = source.size;
+        draft.owned.resize(bucket_count);
+
+        for (size_t i = 0; i < bucket_count; ++i)
+        {
+            draft.owned[i] = buckets[i].get();
+            next->buckets.push_back(move(buckets[i]));
+        }
+
+        draft.next = move(next);
+    }
+
+    void publish(Version *next)
     {
-        return _storage[_hasher(value) % _storage.size()];
+        next->fillViews();
+        const Version *previous = _current.exchange(next);
+        _retired.push_back({previous, _flips});
+        reclaim();
     }
 
-    const BucketList &getBucket(const Type &value) const
+    // Версию, заменённую при _flips == g, может держать читатель любой
+    // чётности: он отметился до замены. Переключение g + 1 дожидается
+    // читателей одной чётности, g + 2 — другой, поэтому после двух
+    // переключений версию никто не держит. Писатель не ждёт читателей:
+    // если полосы не пусты, переключение откладывается до следующей записи.
+    void reclaim()
     {
-        return _storage[_hasher(value) % _storage.size()];
+        for (int i = 0; i < 2 && tryFlip(); ++i)
+        {
+        }
+
+        auto it = remove_if(_retired.begin(), _retired.end(), [this](const Retired &retired)
+        {
+            if (retired.flips + 2 <= _flips)
+            {
+                delete retired.version;
+                return true;
+            }
+
+            return false;
+        });
+
+        _retired.erase(it, _retired.end());
     }
 
-    bool found(const Type &value, const BucketList &bucket) const
+    bool tryFlip()
     {
-        auto result = find(bucket.begin(), bucket.end(), value) != bucket.end();
-        return result;
+        const size_t parity = _parity.load(memory_order_relaxed);
+
+        for (const auto &counters : _readers)
+        {
+            if (counters.active[parity ^ 1].load() != 0)
+            {
+                return false;
+            }
+        }
+
+        _parity.store(parity ^ 1);
+        ++_flips;
+        return true;
     }
 };
 
@@ -156,6 +959,412 @@ void TestEquivalence()
     ASSERT_EQUAL(2, bucket.front().value);
 }
 
+void TestRehash()
+{
+    HashSet<int, IntHasher> hash_set(10);
+
+    for (int value = 0; value < 10000; ++value)
+    {
+        hash_set.Add(value);
+    }
+
+    const auto stats = hash_set.Stats();
+    ASSERT_EQUAL(stats.size, 10000u);
+    ASSERT(stats.load_factor <= 1.0);
+    ASSERT(hash_set.BucketCount() >= 10000u);
+
+    for (int value = 0; value < 10000; value += 2)
+    {
+        hash_set.Erase(value);
+    }
+
+    ASSERT_EQUAL(hash_set.Size(), 5000u);
+    for (int value = 0; value < 10000; ++value)
+    {
+        ASSERT_EQUAL(hash_set.Has(value), value % 2 == 1);
+    }
+}
+
+// Хешер, сохраняющий только старшие биты значения: с остатком от деления
+// на степень двойки все значения попали бы в один бакет
+struct HighBitsHasher
+{
+    size_t operator()(int value) const
+    {
+        return static_cast<size_t>(value) << 20;
+    }
+};
+
+struct ConstantHasher
+{
+    size_t operator()(int) const
+    {
+        return 42;
+    }
+};
+
+void TestStatsDetectBadHasher()
+{
+    HashSet<int, HighBitsHasher> prime(16);
+    HashSet<int, HighBitsHasher, true> power_of_two(16);
+
+    for (int value = 0; value < 4096; ++value)
+    {
+        prime.Add(value);
+        power_of_two.Add(value);
+    }
+
+    const auto mixed = power_of_two.Stats();
+    ASSERT_EQUAL(mixed.bucket_count & (mixed.bucket_count - 1), 0u);
+    ASSERT(mixed.max_chain < 16);
+    ASSERT(mixed.avg_chain < 3);
+
+    for (int value = 0; value < 4096; ++value)
+    {
+        ASSERT(power_of_two.Has(value));
+    }
+
+    // Вырожденный хешер не исправить ростом таблицы, но Stats его выдаёт
+    HashSet<int, ConstantHasher> degenerate(16);
+    for (int value = 0; value < 100; ++value)
+    {
+        degenerate.Add(value);
+    }
+    ASSERT_EQUAL(degenerate.Stats().max_chain, 100u);
+}
+
+void TestFlatSmoke()
+{
+    FlatHashSet<int, IntHasher> hash_set;
+    hash_set.Add(3);
+    hash_set.Add(4);
+
+    ASSERT(hash_set.Has(3));
+    ASSERT(hash_set.Has(4));
+    ASSERT(!hash_set.Has(5));
+
+    hash_set.Erase(3);
+
+    ASSERT(!hash_set.Has(3));
+    ASSERT(hash_set.Has(4));
+    ASSERT(!hash_set.Has(5));
+
+    hash_set.Add(3);
+    hash_set.Add(5);
+
+    ASSERT(hash_set.Has(3));
+    ASSERT(hash_set.Has(4));
+    ASSERT(hash_set.Has(5));
+    ASSERT_EQUAL(hash_set.Size(), 3u);
+}
+
+void TestFlatIdempotency()
+{
+    FlatHashSet<int, IntHasher> hash_set;
+    hash_set.Add(5);
+    hash_set.Add(5);
+    ASSERT(hash_set.Has(5));
+    ASSERT_EQUAL(hash_set.Size(), 1u);
+    hash_set.Erase(5);
+    ASSERT(!hash_set.Has(5));
+    hash_set.Erase(5);
+    ASSERT(!hash_set.Has(5));
+    ASSERT_EQUAL(hash_set.Size(), 0u);
+}
+
+void TestFlatEquivalence()
+{
+    FlatHashSet<TestValue, TestValueHasher> hash_set;
+    hash_set.Add(TestValue{2});
+    hash_set.Add(TestValue{3});
+
+    ASSERT(hash_set.Has(TestValue{2}));
+    ASSERT(hash_set.Has(TestValue{3}));
+    ASSERT_EQUAL(hash_set.Size(), 1u);
+
+    hash_set.Erase(TestValue{3});
+    ASSERT(!hash_set.Has(TestValue{2}));
+}
+
+void TestFlatGrowthAgainstStd()
+{
+    mt19937 gen(42);
+    uniform_int_distribution<int> dist(0, 20000);
+
+    FlatHashSet<int, IntHasher> hash_set;
+    unordered_set<int> expected;
+
+    for (int i = 0; i < 200000; ++i)
+    {
+        const int value = dist(gen);
+
+        if (gen() % 3)
+        {
+            hash_set.Add(value);
+            expected.insert(value);
+        }
+        else
+        {
+            hash_set.Erase(value);
+            expected.erase(value);
+        }
+
+        ASSERT_EQUAL(hash_set.Has(value), expected.count(value) == 1);
+    }
+
+    ASSERT_EQUAL(hash_set.Size(), expected.size());
+    ASSERT(hash_set.Capacity() >= expected.size());
+
+    for (int value = 0; value <= 20000; ++value)
+    {
+        ASSERT_EQUAL(hash_set.Has(value), expected.count(value) == 1);
+    }
+}
+
+void TestFlatStrings()
+{
+    FlatHashSet<string, hash<string>> hash_set;
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        hash_set.Add(to_string(i));
+    }
+    for (int i = 0; i < 1000; i += 2)
+    {
+        hash_set.Erase(to_string(i));
+    }
+
+    ASSERT_EQUAL(hash_set.Size(), 500u);
+    ASSERT(hash_set.Has("999"));
+    ASSERT(!hash_set.Has("998"));
+}
+
+void TestFlatSpeed()
+{
+    const int value_count = 1000000;
+    const int probe_count = 5000000;
+
+    mt19937 gen(42);
+    uniform_int_distribution<int> dist(0, 4 * value_count);
+
+    HashSet<int, IntHasher> chained(value_count);
+    FlatHashSet<int, IntHasher> flat;
+
+    for (int i = 0; i < value_count; ++i)
+    {
+        const int value = dist(gen);
+        chained.Add(value);
+        flat.Add(value);
+    }
+
+    vector<int> probes(probe_count);
+    for (auto &probe : probes)
+    {
+        probe = dist(gen);
+    }
+
+    size_t found = 0;
+    {
+        LOG_DURATION("HashSet::Has");
+        for (int probe : probes)
+        {
+            found += chained.Has(probe);
+        }
+    }
+    {
+        LOG_DURATION("FlatHashSet::Has");
+        for (int probe : probes)
+        {
+            found -= flat.Has(probe);
+        }
+    }
+
+    ASSERT_EQUAL(found, 0u);
+}
+
+void TestConcurrentHashSet()
+{
+    ConcurrentHashSet<int, IntHasher> hash_set(2);
+    hash_set.Add(3);
+    hash_set.Add(4);
+    hash_set.Add(4);
+
+    ASSERT(hash_set.Has(3));
+    ASSERT(hash_set.Has(4));
+    ASSERT(!hash_set.Has(5));
+    ASSERT_EQUAL(hash_set.Size(), 2u);
+
+    hash_set.Erase(3);
+    ASSERT(!hash_set.Has(3));
+    ASSERT_EQUAL(hash_set.Size(), 1u);
+
+    ConcurrentHashSet<TestValue, TestValueHasher> equivalent;
+    equivalent.Add(TestValue{2});
+    ASSERT(equivalent.Has(TestValue{3}));
+}
+
+void TestConcurrentHashSetBatches()
+{
+    ConcurrentHashSet<int, IntHasher> hash_set(2);
+    vector<int> values(1000);
+    iota(values.begin(), values.end(), 0);
+
+    // Повторы внутри порции и рост таблицы посреди порции
+    values.push_back(5);
+    hash_set.AddBatch(values.begin(), values.end());
+    ASSERT_EQUAL(hash_set.Size(), 1000u);
+
+    for (int value = 0; value < 1000; ++value)
+    {
+        ASSERT(hash_set.Has(value));
+    }
+
+    const vector<int> erased = {1, 3, 3, 5, 2000};
+    hash_set.EraseBatch(erased.begin(), erased.end());
+    ASSERT_EQUAL(hash_set.Size(), 997u);
+    ASSERT(!hash_set.Has(3));
+    ASSERT(hash_set.Has(4));
+
+    // Пустые и ничего не меняющие порции не публикуют новую версию
+    hash_set.AddBatch(values.begin(), values.begin());
+    hash_set.EraseBatch(erased.begin(), erased.end());
+    ASSERT_EQUAL(hash_set.Size(), 997u);
+}
+
+void TestConcurrentHashSetReaders()
+{
+    const int permanent_count = 1000;
+    ConcurrentHashSet<int, IntHasher> hash_set;
+
+    for (int value = 0; value < permanent_count; ++value)
+    {
+        hash_set.Add(value);
+    }
+
+    atomic<bool> done{false};
+
+    auto reader = [&hash_set, &done, permanent_count]
+    {
+        size_t checks = 0;
+        for (int value = 0; !done || checks < 100000; value = (value + 1) % permanent_count)
+        {
+            if (!hash_set.Has(value))
+            {
+                return false;
+            }
+            ++checks;
+        }
+        return true;
+    };
+
+    auto r1 = async(launch::async, reader);
+    auto r2 = async(launch::async, reader);
+
+    for (int value = permanent_count; value < 3 * permanent_count; ++value)
+    {
+        hash_set.Add(value);
+        if (value % 2)
+        {
+            hash_set.Erase(value);
+        }
+    }
+    done = true;
+
+    ASSERT(r1.get());
+    ASSERT(r2.get());
+    ASSERT_EQUAL(hash_set.Size(), 2u * permanent_count);
+
+    // Читателей больше нет, следующая запись освобождает все старые версии
+    hash_set.Add(-1);
+    ASSERT_EQUAL(hash_set.RetiredCount(), 0u);
+}
+
+void TestConcurrentHashSetSpeed()
+{
+    const int value_count = 10000;
+    const int probe_count = 1000000;
+
+    // Та же раскладка по младшим битам перемешанного хеша, что
+    // у ConcurrentHashSet, иначе сравнивается локальность, а не синхронизация
+    HashSet<int, IntHasher, true> guarded(value_count);
+    mutex locker;
+    ConcurrentHashSet<int, IntHasher> concurrent(value_count);
+
+    for (int value = 0; value < value_count; ++value)
+    {
+        guarded.Add(value * 3);
+        concurrent.Add(value * 3);
+    }
+
+    auto run = [](auto has)
+    {
+        vector<future<size_t>> futures;
+        for (int i = 0; i < 4; ++i)
+        {
+            futures.push_back(async(launch::async, [has, probe_count]
+            {
+                size_t found = 0;
+                for (int value = 0; value < probe_count; ++value)
+                {
+                    found += has(value);
+                }
+                return found;
+            }));
+        }
+
+        size_t found = 0;
+        for (auto &f : futures)
+        {
+            found += f.get();
+        }
+        return found;
+    };
+
+    size_t found_guarded, found_concurrent;
+    {
+        LOG_DURATION("HashSet under mutex");
+        found_guarded = run([&](int value)
+        {
+            lock_guard<mutex> guard(locker);
+            return guarded.Has(value);
+        });
+    }
+    {
+        LOG_DURATION("ConcurrentHashSet");
+        found_concurrent = run([&](int value)
+        {
+            return concurrent.Has(value);
+        });
+    }
+
+    ASSERT_EQUAL(found_guarded, found_concurrent);
+
+    // Заполнение: одиночный Add копирует таблицу бакетов, порция — один раз
+    vector<int> values(2000);
+    iota(values.begin(), values.end(), 0);
+    {
+        LOG_DURATION("ConcurrentHashSet, 2K single Add");
+        ConcurrentHashSet<int, IntHasher> filled;
+        for (int value : values)
+        {
+            filled.Add(value);
+        }
+    }
+    {
+        LOG_DURATION("ConcurrentHashSet, 2K in one AddBatch");
+        ConcurrentHashSet<int, IntHasher> filled;
+        filled.AddBatch(values.begin(), values.end());
+    }
+    vector<int> many(1000000);
+    iota(many.begin(), many.end(), 0);
+    {
+        LOG_DURATION("ConcurrentHashSet, 1M in one AddBatch");
+        ConcurrentHashSet<int, IntHasher> filled;
+        filled.AddBatch(many.begin(), many.end());
+        ASSERT_EQUAL(filled.Size(), many.size());
+    }
+}
+
 int main()
 {
     TestRunner tr;
@@ -163,5 +1372,17 @@ int main()
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestIdempotency);
     RUN_TEST(tr, TestEquivalence);
+    RUN_TEST(tr, TestRehash);
+    RUN_TEST(tr, TestStatsDetectBadHasher);
+    RUN_TEST(tr, TestConcurrentHashSet);
+    RUN_TEST(tr, TestConcurrentHashSetBatches);
+    RUN_TEST(tr, TestConcurrentHashSetReaders);
+    RUN_TEST(tr, TestConcurrentHashSetSpeed);
+    RUN_TEST(tr, TestFlatSmoke);
+    RUN_TEST(tr, TestFlatIdempotency);
+    RUN_TEST(tr, TestFlatEquivalence);
+    RUN_TEST(tr, TestFlatGrowthAgainstStd);
+    RUN_TEST(tr, TestFlatStrings);
+    RUN_TEST(tr, TestFlatSpeed);
     return 0;
 }
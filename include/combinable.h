@@ -0,0 +1,68 @@
+#pragma once
+
+#include "thread_slots.h"
+
+#include <functional>
+#include <memory>
+
+// Значение, которое каждый поток накапливает в собственной копии (шарде).
+// Шард принадлежит одному потоку, поэтому запись в него идёт без
+// блокировок и не конкурирует с другими потоками. Итоговое значение
+// собирается пользовательской функцией слияния. Шард завершившегося
+// потока сохраняет значение и достаётся следующему новому потоку.
+template <typename T>
+class Combinable
+{
+public:
+    struct Access
+    {
+        T &ref_to_value;
+    };
+
+    explicit Combinable(std::function<T()> init = [] { return T(); })
+        : _init(std::move(init))
+        , _shards([this] { return std::make_unique<Shard>(_init()); })
+    {
+    }
+
+    Combinable(const Combinable &) = delete;
+    Combinable &operator=(const Combinable &) = delete;
+
+    Access GetAccess()
+    {
+        return {_shards.Local().value};
+    }
+
+    // merge(T &result, const T &shard) добавляет шард к результату.
+    // Вызывается, когда пишущие потоки закончили работу и их завершение
+    // синхронизировано с вызывающим (join, future::get): сами шарды
+    // не защищены, синхронизируется только список шардов.
+    template <typename Merge>
+    T Combine(Merge merge) const
+    {
+        T result = _init();
+        _shards.ForEach([&result, &merge](const Shard &shard)
+        {
+            merge(result, shard.value);
+        });
+        return result;
+    }
+
+    size_t ShardCount() const
+    {
+        return _shards.Size();
+    }
+
+private:
+    struct alignas(64) Shard
+    {
+        explicit Shard(T initial) : value(std::move(initial))
+        {
+        }
+
+        T value;
+    };
+
+    const std::function<T()> _init;
+    ThreadSlots<Shard> _shards;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// Финализатор MurmurHash3 (fmix64): каждый бит входа влияет на все биты
+// результата, поэтому после него можно брать как старшие, так и младшие
+// биты хеша, даже если исходный хешер тождественный
+inline size_t MixHash(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Последовательно подмешивает хеши в результат без промежуточных
+// контейнеров. Порядок аргументов важен: (a, b) и (b, a) дают разные хеши.
+template <typename... Hashes>
+size_t CombineHashes(Hashes... hashes)
+{
+    uint64_t result = 0;
+    ((result = MixHash(result * 0x9e3779b97f4a7c15ULL + static_cast<uint64_t>(hashes))), ...);
+    return result;
+}
+
+// Хеш набора значений через std::hash каждого из них
+template <typename... Values>
+size_t HashValues(const Values &... values)
+{
+    return CombineHashes(std::hash<Values>{}(values)...);
+}
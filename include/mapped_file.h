@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Файл, отображённый в память только для чтения. Содержимое доступно
+// без копирования, страницы подгружаются ядром по мере обращения.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+
+    explicit MappedFile(const std::string &path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+
+        struct stat info;
+
+        if (::fstat(fd, &info) < 0)
+        {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+
+        _size = info.st_size;
+
+        if (_size > 0)
+        {
+            void *data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (data == MAP_FAILED)
+            {
+                const int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), path);
+            }
+
+            _data = static_cast<const char *>(data);
+        }
+
+        ::close(fd);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    MappedFile(MappedFile &&other) noexcept
+        : _data(std::exchange(other._data, nullptr))
+        , _size(std::exchange(other._size, 0))
+    {
+    }
+
+    MappedFile &operator=(MappedFile &&other) noexcept
+    {
+        std::swap(_data, other._data);
+        std::swap(_size, other._size);
+        return *this;
+    }
+
+    ~MappedFile()
+    {
+        if (_data)
+        {
+            ::munmap(const_cast<char *>(_data), _size);
+        }
+    }
+
+    const char *Data() const
+    {
+        return _data;
+    }
+
+    size_t Size() const
+    {
+        return _size;
+    }
+
+    std::string_view View() const
+    {
+        return {_data, _size};
+    }
+
+private:
+    const char *_data = nullptr;
+    size_t _size = 0;
+};
@@ -60,6 +60,17 @@ std::ostream &operator << (std::ostream &os, const std::map<K, V> &m)
     return os << "}";
 }
 
+template <typename K, typename V>
+std::ostream &operator<<(std::ostream &os, const std::unordered_map<K, V> &m)
+{
+    for (const auto &i : m)
+    {
+        os << "[" << i.first << ", " << i.second << "] ";
+    }
+
+    return os;
+}
+
 template<class T, class U>
 void AssertEqual(const T &t, const U &u, const std::string &hint = {})
 {
@@ -116,17 +127,6 @@ private:
     int fail_count = 0;
 };
 
-template <typename K, typename V>
-std::ostream &operator<<(std::ostream &os, const std::unordered_map<K, V> &m)
-{
-    for (const auto &i : m)
-    {
-        os << "[" << i.first << ", " << i.second << "] ";
-    }
-
-    return os;
-}
-
 #define ASSERT_EQUAL(x, y) {            \
   std::ostringstream osAssert;               \
   osAssert << #x << " != " << #y << ", "\
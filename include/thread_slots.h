@@ -0,0 +1,192 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace thread_slots_detail
+{
+    // Слоты всех объектов ThreadSlots, к которым обращался поток.
+    // Последний использованный слот кэшируется по идентификатору владельца:
+    // идентификаторы не переиспользуются, поэтому кэш не нужно сбрасывать.
+    struct Registry
+    {
+        using Exited = void (*)(void *owner, void *slot, Registry *registry);
+
+        struct Entry
+        {
+            void *slot;
+            Exited exited;
+        };
+
+        size_t lastId = 0;
+        void *lastSlot = nullptr;
+
+        // Читает поток-хозяин, изменяют владельцы слотов при разрушении
+        std::mutex locker;
+        std::unordered_map<void *, Entry> entries;
+
+        ~Registry();
+    };
+
+    // Порядок захвата: GlobalLocker, мьютекс владельца, мьютекс реестра.
+    // Глобальный мьютекс берётся только при первом обращении потока
+    // к владельцу, при завершении потока и при разрушении владельца.
+    inline std::mutex &GlobalLocker()
+    {
+        static std::mutex locker;
+        return locker;
+    }
+
+    inline Registry::~Registry()
+    {
+        std::lock_guard<std::mutex> guard(GlobalLocker());
+
+        for (const auto &[owner, entry] : entries)
+        {
+            entry.exited(owner, entry.slot, this);
+        }
+    }
+
+    inline Registry &LocalRegistry()
+    {
+        thread_local Registry registry;
+        return registry;
+    }
+
+    inline size_t NextId()
+    {
+        static std::atomic<size_t> counter{0};
+        return ++counter;
+    }
+}
+
+// Слот на каждый поток, обращающийся к объекту: шард счётчика, магазин
+// пула, отметка читателя. Повторные обращения потока к тому же объекту
+// не трогают общих данных. Когда поток завершается, его слот передаётся
+// on_thread_exit и возвращается в список свободных для следующих потоков,
+// а при разрушении владельца его записи удаляются из реестров всех потоков.
+template <typename Slot>
+class ThreadSlots
+{
+public:
+    using Registry = thread_slots_detail::Registry;
+
+    explicit ThreadSlots(
+        std::function<std::unique_ptr<Slot>()> make = [] { return std::make_unique<Slot>(); },
+        std::function<void(Slot &)> on_thread_exit = [](Slot &) {}
+    )
+        : _make(std::move(make))
+        , _onThreadExit(std::move(on_thread_exit))
+        , _id(thread_slots_detail::NextId())
+    {
+    }
+
+    ThreadSlots(const ThreadSlots &) = delete;
+    ThreadSlots &operator=(const ThreadSlots &) = delete;
+
+    ~ThreadSlots()
+    {
+        std::lock_guard<std::mutex> guard(thread_slots_detail::GlobalLocker());
+
+        for (Registry *registry : _threads)
+        {
+            std::lock_guard<std::mutex> registryGuard(registry->locker);
+            registry->entries.erase(this);
+        }
+    }
+
+    Slot &Local()
+    {
+        Registry &registry = thread_slots_detail::LocalRegistry();
+
+        if (registry.lastId != _id)
+        {
+            Slot *slot = find(registry);
+            registry.lastSlot = slot ? slot : attach(registry);
+            registry.lastId = _id;
+        }
+
+        return *static_cast<Slot *>(registry.lastSlot);
+    }
+
+    // Обходит все слоты, включая свободные, под мьютексом владельца
+    template <typename Func>
+    void ForEach(Func func) const
+    {
+        std::lock_guard<std::mutex> guard(_locker);
+
+        for (const auto &slot : _slots)
+        {
+            func(*slot);
+        }
+    }
+
+    size_t Size() const
+    {
+        std::lock_guard<std::mutex> guard(_locker);
+        return _slots.size();
+    }
+
+private:
+    const std::function<std::unique_ptr<Slot>()> _make;
+    const std::function<void(Slot &)> _onThreadExit;
+    const size_t _id;
+
+    mutable std::mutex _locker;
+    std::vector<std::unique_ptr<Slot>> _slots;
+    std::vector<Slot *> _free;
+    std::unordered_set<Registry *> _threads;
+
+    Slot *find(Registry &registry)
+    {
+        std::lock_guard<std::mutex> guard(registry.locker);
+        auto it = registry.entries.find(this);
+        return it == registry.entries.end() ? nullptr : static_cast<Slot *>(it->second.slot);
+    }
+
+    Slot *attach(Registry &registry)
+    {
+        std::lock_guard<std::mutex> globalGuard(thread_slots_detail::GlobalLocker());
+        Slot *slot;
+
+        {
+            std::lock_guard<std::mutex> guard(_locker);
+
+            if (_free.empty())
+            {
+                _slots.push_back(_make());
+                slot = _slots.back().get();
+            }
+            else
+            {
+                slot = _free.back();
+                _free.pop_back();
+            }
+
+            _threads.insert(&registry);
+        }
+
+        std::lock_guard<std::mutex> registryGuard(registry.locker);
+        registry.entries[this] = {slot, &exited};
+        return slot;
+    }
+
+    // Вызывается из деструктора реестра завершающегося потока
+    // под глобальным мьютексом, поэтому владелец ещё жив
+    static void exited(void *owner, void *slot, Registry *registry)
+    {
+        auto *self = static_cast<ThreadSlots *>(owner);
+        auto *typed = static_cast<Slot *>(slot);
+        self->_onThreadExit(*typed);
+
+        std::lock_guard<std::mutex> guard(self->_locker);
+        self->_threads.erase(registry);
+        self->_free.push_back(typed);
+    }
+};
@@ -3,9 +3,18 @@
 #include <functional>
 #include <string>
 #include <optional>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
+// Потокобезопасна: _init выполняется ровно один раз, даже если Get
+// вызывают одновременно из нескольких потоков. После инициализации
+// Get стоит одной загрузки атомарного флага с acquire.
 template <typename T>
 class LazyValue
 {
@@ -16,14 +25,18 @@ public:
 
     bool HasValue() const
     {
-        return _value.has_value();
+        return _ready.load(memory_order_acquire);
     }
 
     const T &Get() const
     {
-        if (!_value)
+        if (!_ready.load(memory_order_acquire))
         {
-            _value = _init();
+            call_once(_once, [this]
+            {
+                _value = _init();
+                _ready.store(true, memory_order_release);
+            });
         }
 
         return *_value;
@@ -32,7 +45,33 @@ public:
 private:
     const function<T()> _init;
     mutable optional<T> _value;
+    mutable once_flag _once;
+    mutable atomic<bool> _ready{false};
+};
+
+// Запускает _init в фоновом потоке сразу при создании,
+// Get дожидается готовности значения
+template <typename T>
+class AsyncLazyValue
+{
+public:
+    explicit AsyncLazyValue(function<T()> init)
+        : _value(async(launch::async, move(init)).share())
+    {
+    }
+
+    bool HasValue() const
+    {
+        return _value.wait_for(chrono::seconds(0)) == future_status::ready;
+    }
 
+    const T &Get() const
+    {
+        return _value.get();
+    }
+
+private:
+    shared_future<T> _value;
 };
 
 void UseExample()
@@ -60,10 +99,55 @@ void TestInitializerIsntCalled()
     ASSERT(!called);
 }
 
+void TestConcurrentGet()
+{
+    atomic<int> calls{0};
+    LazyValue<vector<int>> lazy_table([&calls]
+    {
+        ++calls;
+        this_thread::sleep_for(chrono::milliseconds(10));
+        return vector<int>(1000, 42);
+    });
+
+    vector<future<size_t>> futures;
+    for (int i = 0; i < 8; ++i)
+    {
+        futures.push_back(async(launch::async, [&lazy_table]
+        {
+            return lazy_table.Get().size();
+        }));
+    }
+
+    for (auto &f : futures)
+    {
+        ASSERT_EQUAL(f.get(), 1000u);
+    }
+
+    ASSERT(lazy_table.HasValue());
+    ASSERT_EQUAL(calls.load(), 1);
+}
+
+void TestAsyncLazyValue()
+{
+    const string big_string = "Giant amounts of memory";
+
+    AsyncLazyValue<string> lazy_string([&big_string]
+    {
+        this_thread::sleep_for(chrono::milliseconds(10));
+        return big_string;
+    });
+
+    ASSERT_EQUAL(lazy_string.Get(), big_string);
+    ASSERT(lazy_string.HasValue());
+    ASSERT_EQUAL(&lazy_string.Get(), &lazy_string.Get());
+}
+
 int main()
 {
     TestRunner tr;
     RUN_TEST(tr, UseExample);
     RUN_TEST(tr, TestInitializerIsntCalled);
+    RUN_TEST(tr, TestConcurrentGet);
+    RUN_TEST(tr, TestAsyncLazyValue);
     return 0;
 }
@@ -1,79 +1,561 @@
 #include "test_runner.h"
+#include "profile.h"
+#include "thread_slots.h"
 
 #include <algorithm>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include <iostream>
 #include <string>
-#include <queue>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <tuple>
+#include <new>
 #include <stdexcept>
-#include <unordered_set>
+#include <vector>
 using namespace std;
 
+// Объекты размещаются в слотах блоков памяти (слэбов) одного размера,
+// выровненных по этому размеру. Освобождённые объекты не разрушаются
+// и попадают в конец интрузивного списка, так что переиспользуются
+// в порядке освобождения. Принадлежность пулу проверяется двоичным
+// поиском по отсортированному массиву начал блоков и проверкой, что адрес
+// не выходит за найденный блок, а повторное освобождение — по флагу слота.
 template <class T>
 class ObjectPool
 {
 public:
+    ObjectPool() = default;
+
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
     T *Allocate()
     {
-        T *result;
+        if (T *result = TryAllocate())
+        {
+            return result;
+        }
+
+        Slot &slot = newSlot();
+        new (slot.storage) T;
+        ++_chunks.back()->used;
+
+        slot.allocated = true;
+        return slot.object();
+    }
+
+    T *TryAllocate()
+    {
+        if (!_freeHead)
+        {
+            return nullptr;
+        }
 
-        if (_deallocated.empty())
+        Slot *slot = _freeHead;
+        _freeHead = slot->next;
+
+        if (!_freeHead)
         {
-            result = new T;
+            _freeTail = nullptr;
+        }
+
+        slot->allocated = true;
+        return slot->object();
+    }
+
+    void Deallocate(T *object)
+    {
+        Slot *slot = findSlot(object);
+
+        if (!slot || !slot->allocated)
+        {
+            throw invalid_argument("wrong deallocation");
+        }
+
+        slot->allocated = false;
+        slot->next = nullptr;
+
+        if (_freeTail)
+        {
+            _freeTail->next = slot;
         }
         else
         {
-            result = _deallocated.front();
-            _deallocated.pop();
+            _freeHead = slot;
         }
 
-        _allocated.insert(result);
-        return result;
+        _freeTail = slot;
     }
 
-    T *TryAllocate()
+    // Отсортированные начала всех блоков пула и начало блока, которому
+    // принадлежал бы объект: по ним ConcurrentObjectPool проверяет
+    // принадлежность сам
+    const vector<uintptr_t> &ChunkStarts() const
+    {
+        return _chunkStarts;
+    }
+
+    // Начало блока из starts, внутри которого лежит объект, или 0
+    static uintptr_t FindChunk(const vector<uintptr_t> &starts, const T *object)
+    {
+        const auto address = reinterpret_cast<uintptr_t>(object);
+        auto it = upper_bound(starts.begin(), starts.end(), address);
+
+        if (it == starts.begin() || address - *prev(it) >= CHUNK_BYTES)
+        {
+            return 0;
+        }
+
+        return *prev(it);
+    }
+
+    static uintptr_t ChunkStart(const T *object)
+    {
+        return reinterpret_cast<uintptr_t>(object) & ~static_cast<uintptr_t>(CHUNK_BYTES - 1);
+    }
+
+    // Адрес приходится на начало объекта в каком-то слоте блока; заголовок
+    // блока при этом не читается, поэтому проверка годится и без мьютекса
+    static bool IsSlotObject(const T *object)
+    {
+        const auto address = reinterpret_cast<uintptr_t>(object);
+        const uintptr_t start = ChunkStart(object);
+
+        if (address - start < SLOTS_OFFSET)
+        {
+            return false;
+        }
+
+        const size_t offset = address - start - SLOTS_OFFSET;
+        return offset % sizeof(Slot) == offsetof(Slot, storage) && offset / sizeof(Slot) < CHUNK_CAPACITY;
+    }
+
+    ~ObjectPool()
+    {
+        for (ChunkHeader *chunk : _chunks)
+        {
+            for (size_t i = 0; i < chunk->used; ++i)
+            {
+                slotAt(chunk, i).object()->~T();
+            }
+
+            ::operator delete(chunk, align_val_t(CHUNK_BYTES));
+        }
+    }
+
+private:
+    struct Slot
     {
-        if (_deallocated.empty())
+        Slot *next;
+        bool allocated;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T *object()
+        {
+            return launder(reinterpret_cast<T *>(storage));
+        }
+    };
+
+    // Заголовок в начале блока, за ним идут слоты
+    struct ChunkHeader
+    {
+        size_t used;
+    };
+
+    static constexpr size_t MIN_CHUNK_BYTES = 16384;
+    static constexpr size_t MIN_CHUNK_SLOTS = 32;
+    static constexpr size_t SLOTS_OFFSET =
+        (sizeof(ChunkHeader) + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+
+    static constexpr size_t chunkBytes()
+    {
+        size_t bytes = MIN_CHUNK_BYTES;
+
+        while (bytes < SLOTS_OFFSET + MIN_CHUNK_SLOTS * sizeof(Slot))
+        {
+            bytes *= 2;
+        }
+
+        return bytes;
+    }
+
+    static constexpr size_t CHUNK_BYTES = chunkBytes();
+    static constexpr size_t CHUNK_CAPACITY = (CHUNK_BYTES - SLOTS_OFFSET) / sizeof(Slot);
+
+    vector<ChunkHeader *> _chunks;
+    vector<uintptr_t> _chunkStarts;
+    Slot *_freeHead = nullptr;
+    Slot *_freeTail = nullptr;
+
+    static Slot &slotAt(ChunkHeader *chunk, size_t index)
+    {
+        auto *slots = reinterpret_cast<unsigned char *>(chunk) + SLOTS_OFFSET;
+        return *launder(reinterpret_cast<Slot *>(slots + index * sizeof(Slot)));
+    }
+
+    // Слот ещё не занят: счётчик used увеличивается только после
+    // успешного конструирования объекта
+    Slot &newSlot()
+    {
+        if (_chunks.empty() || _chunks.back()->used == CHUNK_CAPACITY)
+        {
+            _chunks.reserve(_chunks.size() + 1);
+            _chunkStarts.reserve(_chunkStarts.size() + 1);
+
+            void *memory = ::operator new(CHUNK_BYTES, align_val_t(CHUNK_BYTES));
+            _chunks.push_back(new (memory) ChunkHeader{0});
+
+            const auto start = reinterpret_cast<uintptr_t>(memory);
+            _chunkStarts.insert(upper_bound(_chunkStarts.begin(), _chunkStarts.end(), start), start);
+        }
+
+        ChunkHeader *chunk = _chunks.back();
+        auto *slots = reinterpret_cast<unsigned char *>(chunk) + SLOTS_OFFSET;
+        return *new (slots + chunk->used * sizeof(Slot)) Slot{nullptr, false};
+    }
+
+    Slot *findSlot(const T *object) const
+    {
+        const auto address = reinterpret_cast<uintptr_t>(object);
+        const uintptr_t start = FindChunk(_chunkStarts, object);
+
+        // Заголовок чужой памяти читать нельзя, поэтому сначала
+        // находится наш блок, содержащий адрес
+        if (!start || address - start < SLOTS_OFFSET)
         {
             return nullptr;
         }
 
-        T* result = _deallocated.front();
-        _deallocated.pop();
-        _allocated.insert(result);
+        const size_t offset = address - start - SLOTS_OFFSET;
+        auto *chunk = reinterpret_cast<ChunkHeader *>(start);
+
+        if (!IsSlotObject(object) || offset / sizeof(Slot) >= chunk->used)
+        {
+            return nullptr;
+        }
+
+        return &slotAt(chunk, offset / sizeof(Slot));
+    }
+};
+
+// Владеющий указатель на объект пула по образцу UniquePtr:
+// при разрушении возвращает объект в пул вместо delete
+template <class T>
+class PooledPtr
+{
+private:
+    ObjectPool<T> *_pool = nullptr;
+    T *_ptr = nullptr;
+
+    void deallocate()
+    {
+        if (_ptr)
+        {
+            _pool->Deallocate(_ptr);
+            _ptr = nullptr;
+        }
+    }
+
+public:
+    PooledPtr()
+    {}
+
+    explicit PooledPtr(ObjectPool<T> &pool) : _pool(&pool), _ptr(pool.Allocate())
+    {}
+
+    PooledPtr(ObjectPool<T> &pool, T *ptr) : _pool(&pool), _ptr(ptr)
+    {}
+
+    PooledPtr(const PooledPtr &) = delete;
+    PooledPtr &operator = (const PooledPtr &) = delete;
+
+    PooledPtr(PooledPtr &&other) : _pool(other._pool), _ptr(other._ptr)
+    {
+        other._ptr = nullptr;
+    }
+
+    PooledPtr &operator = (PooledPtr &&other)
+    {
+        if (this != &other)
+        {
+            deallocate();
+            _pool = other._pool;
+            _ptr = other._ptr;
+            other._ptr = nullptr;
+        }
+
+        return *this;
+    }
+
+    ~PooledPtr()
+    {
+        deallocate();
+    }
+
+    T &operator * () const
+    {
+        return *_ptr;
+    }
+
+    T *operator -> () const
+    {
+        return _ptr;
+    }
+
+    T *Get() const
+    {
+        return _ptr;
+    }
+
+    // Объект остаётся выделенным в пуле, вернуть его должен вызывающий
+    T *Release()
+    {
+        auto tmp = _ptr;
+        _ptr = nullptr;
+        return tmp;
+    }
+
+    void Reset()
+    {
+        deallocate();
+    }
+};
+
+// Ресурс памяти для pmr-контейнеров поверх ObjectPool: запросы небольших
+// размеров обслуживаются пулами блоков фиксированного размера, остальные
+// передаются вышестоящему ресурсу. Память блоков освобождается
+// вместе с ресурсом, поэтому контейнеры должны быть уничтожены раньше.
+class PoolMemoryResource : public pmr::memory_resource
+{
+public:
+    explicit PoolMemoryResource(pmr::memory_resource *upstream = pmr::get_default_resource())
+        : _upstream(upstream)
+    {
+    }
+
+private:
+    template <size_t Size>
+    struct Block
+    {
+        alignas(max_align_t) unsigned char data[Size];
+    };
+
+    using Pools = tuple<
+        ObjectPool<Block<16>>,
+        ObjectPool<Block<32>>,
+        ObjectPool<Block<64>>,
+        ObjectPool<Block<128>>,
+        ObjectPool<Block<256>>
+    >;
+
+    pmr::memory_resource *_upstream;
+    Pools _pools;
+
+    template <size_t I = 0>
+    void *allocateBlock(size_t bytes, size_t alignment)
+    {
+        if constexpr (I == tuple_size_v<Pools>)
+        {
+            return _upstream->allocate(bytes, alignment);
+        }
+        else
+        {
+            if (bytes <= (16u << I))
+            {
+                return get<I>(_pools).Allocate();
+            }
+
+            return allocateBlock<I + 1>(bytes, alignment);
+        }
+    }
+
+    template <size_t I = 0>
+    void deallocateBlock(void *p, size_t bytes, size_t alignment)
+    {
+        if constexpr (I == tuple_size_v<Pools>)
+        {
+            _upstream->deallocate(p, bytes, alignment);
+        }
+        else
+        {
+            if (bytes <= (16u << I))
+            {
+                using BlockType = Block<(16u << I)>;
+                get<I>(_pools).Deallocate(static_cast<BlockType *>(p));
+                return;
+            }
+
+            deallocateBlock<I + 1>(p, bytes, alignment);
+        }
+    }
+
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        if (alignment > alignof(max_align_t))
+        {
+            return _upstream->allocate(bytes, alignment);
+        }
+
+        return allocateBlock(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override
+    {
+        if (alignment > alignof(max_align_t))
+        {
+            _upstream->deallocate(p, bytes, alignment);
+            return;
+        }
+
+        deallocateBlock(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+// Многопоточный фронтенд к ObjectPool. Каждый поток держит свой магазин
+// свободных объектов и обращается к общему складу под мьютексом только
+// пачками: когда магазин пуст или переполнен, а также при завершении
+// потока, когда магазин целиком возвращается на склад. Объект,
+// освобождённый в другом потоке, попадает в магазин этого потока для
+// того же пула, поэтому всегда возвращается пулу-владельцу.
+// Принадлежность пулу проверяется по копии массива начал блоков в магазине,
+// которая обновляется под мьютексом, только когда блоков стало больше.
+// Повторное освобождение, в отличие от ObjectPool, не обнаруживается.
+template <class T>
+class ConcurrentObjectPool
+{
+public:
+    explicit ConcurrentObjectPool(size_t magazine_size = 64)
+        : _magazineSize(max<size_t>(magazine_size, 1))
+        , _magazines([] { return make_unique<Magazine>(); }, [this](Magazine &magazine)
+        {
+            returnToDepot(magazine);
+        })
+    {
+    }
+
+    ConcurrentObjectPool(const ConcurrentObjectPool &) = delete;
+    ConcurrentObjectPool &operator=(const ConcurrentObjectPool &) = delete;
+
+    T *Allocate()
+    {
+        Magazine &magazine = _magazines.Local();
+
+        if (magazine.objects.empty())
+        {
+            refill(magazine);
+        }
+
+        T *result = magazine.objects.back();
+        magazine.objects.pop_back();
         return result;
     }
 
     void Deallocate(T *object)
     {
-        auto it = _allocated.find(object);
+        Magazine &magazine = _magazines.Local();
+
+        const uintptr_t chunk = ObjectPool<T>::ChunkStart(object);
+
+        if (!object || !ObjectPool<T>::IsSlotObject(object))
+        {
+            throw invalid_argument("wrong deallocation");
+        }
 
-        if (it == _allocated.end())
+        if (chunk != magazine.lastChunk && !ObjectPool<T>::FindChunk(magazine.chunks, object)
+            && !refreshChunks(magazine, object))
         {
             throw invalid_argument("wrong deallocation");
         }
 
-        _allocated.erase(it);
-        _deallocated.push(object);
+        magazine.lastChunk = chunk;
+        magazine.objects.push_back(object);
+
+        if (magazine.objects.size() >= 2 * _magazineSize)
+        {
+            drain(magazine);
+        }
     }
 
-    ~ObjectPool()
+    // Объекты, лежащие на складе, без учёта магазинов живых потоков
+    size_t DepotSize()
+    {
+        lock_guard<mutex> guard(_depotLocker);
+        return _depot.size();
+    }
+
+private:
+    struct Magazine
     {
-        for (const auto &p : _allocated)
+        vector<T *> objects;
+        vector<uintptr_t> chunks;
+        // Соседние освобождения обычно приходятся на один блок. Начала
+        // блоков выровнены, поэтому единица не совпадёт ни с одним из них
+        uintptr_t lastChunk = 1;
+    };
+
+    const size_t _magazineSize;
+
+    mutex _depotLocker;
+    ObjectPool<T> _pool;
+    vector<T *> _depot;
+
+    // Объявлен последним, чтобы разрушиться первым: после этого
+    // завершающиеся потоки уже не возвращают магазины на склад
+    ThreadSlots<Magazine> _magazines;
+
+    void refill(Magazine &magazine)
+    {
+        lock_guard<mutex> guard(_depotLocker);
+
+        const size_t taken = min(_depot.size(), _magazineSize);
+        magazine.objects.insert(magazine.objects.end(), _depot.end() - taken, _depot.end());
+        _depot.resize(_depot.size() - taken);
+
+        while (magazine.objects.size() < _magazineSize)
         {
-            delete p;
+            magazine.objects.push_back(_pool.Allocate());
         }
+    }
+
+    void drain(Magazine &magazine)
+    {
+        lock_guard<mutex> guard(_depotLocker);
+        _depot.insert(_depot.end(), magazine.objects.begin() + _magazineSize, magazine.objects.end());
+        magazine.objects.resize(_magazineSize);
+    }
+
+    void returnToDepot(Magazine &magazine)
+    {
+        lock_guard<mutex> guard(_depotLocker);
+        _depot.insert(_depot.end(), magazine.objects.begin(), magazine.objects.end());
+        magazine.objects.clear();
+    }
 
-        while (!_deallocated.empty())
+    // Объект мог быть выделен из блока, появившегося после последнего
+    // обновления копии; чужие указатели платят за проверку мьютексом
+    bool refreshChunks(Magazine &magazine, const T *object)
+    {
+        lock_guard<mutex> guard(_depotLocker);
+
+        if (magazine.chunks.size() != _pool.ChunkStarts().size())
         {
-            auto p = _deallocated.front();
-            delete p;
-            _deallocated.pop();
+            magazine.chunks = _pool.ChunkStarts();
         }
-    }
 
-private:
-    unordered_set<T*> _allocated;
-    queue<T*> _deallocated;
+        return ObjectPool<T>::FindChunk(magazine.chunks, object) != 0;
+    }
 };
 
 void TestObjectPool()
@@ -99,9 +581,382 @@ void TestObjectPool()
     pool.Deallocate(p1);
 }
 
+void TestWrongDeallocation()
+{
+    ObjectPool<string> pool;
+    ObjectPool<string> other_pool;
+
+    auto p1 = pool.Allocate();
+    auto p2 = other_pool.Allocate();
+    string local;
+
+    bool thrown = false;
+    try
+    {
+        pool.Deallocate(p2);
+    }
+    catch (invalid_argument &)
+    {
+        thrown = true;
+    }
+    ASSERT(thrown);
+
+    thrown = false;
+    try
+    {
+        pool.Deallocate(&local);
+    }
+    catch (invalid_argument &)
+    {
+        thrown = true;
+    }
+    ASSERT(thrown);
+
+    // Адрес внутри блока пула, но не начало объекта
+    thrown = false;
+    try
+    {
+        pool.Deallocate(reinterpret_cast<string *>(reinterpret_cast<char *>(p1) + 1));
+    }
+    catch (invalid_argument &)
+    {
+        thrown = true;
+    }
+    ASSERT(thrown);
+
+    pool.Deallocate(p1);
+
+    thrown = false;
+    try
+    {
+        pool.Deallocate(p1);
+    }
+    catch (invalid_argument &)
+    {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void TestManyObjects()
+{
+    ObjectPool<int> pool;
+    vector<int *> objects;
+
+    for (int i = 0; i < 10000; ++i)
+    {
+        objects.push_back(pool.Allocate());
+        *objects.back() = i;
+    }
+
+    for (int i = 0; i < 10000; ++i)
+    {
+        ASSERT_EQUAL(*objects[i], i);
+    }
+
+    for (int i = 0; i < 10000; i += 2)
+    {
+        pool.Deallocate(objects[i]);
+    }
+
+    for (int i = 0; i < 10000; i += 2)
+    {
+        ASSERT_EQUAL(pool.TryAllocate(), objects[i]);
+    }
+    ASSERT(pool.TryAllocate() == nullptr);
+}
+
+void TestSpeed()
+{
+    const int object_count = 1000;
+    const int round_count = 1000;
+    vector<string *> objects(object_count);
+
+    {
+        LOG_DURATION("new/delete");
+        for (int round = 0; round < round_count; ++round)
+        {
+            for (auto &p : objects)
+            {
+                p = new string;
+            }
+            for (auto p : objects)
+            {
+                delete p;
+            }
+        }
+    }
+    {
+        LOG_DURATION("ObjectPool");
+        ObjectPool<string> pool;
+        for (int round = 0; round < round_count; ++round)
+        {
+            for (auto &p : objects)
+            {
+                p = pool.Allocate();
+            }
+            for (auto p : objects)
+            {
+                pool.Deallocate(p);
+            }
+        }
+    }
+}
+
+void TestPooledPtr()
+{
+    ObjectPool<string> pool;
+
+    string *raw;
+    {
+        PooledPtr<string> ptr(pool);
+        *ptr = "first";
+        raw = ptr.Get();
+
+        PooledPtr<string> moved(move(ptr));
+        ASSERT(ptr.Get() == nullptr);
+        ASSERT_EQUAL(moved->size(), 5u);
+
+        PooledPtr<string> assigned;
+        assigned = move(moved);
+        ASSERT_EQUAL(*assigned, "first");
+    }
+
+    ASSERT_EQUAL(pool.TryAllocate(), raw);
+    ASSERT(pool.TryAllocate() == nullptr);
+
+    PooledPtr<string> adopted(pool, raw);
+    ASSERT_EQUAL(adopted.Release(), raw);
+    pool.Deallocate(raw);
+}
+
+void TestPoolMemoryResource()
+{
+    PoolMemoryResource resource;
+
+    pmr::list<int> numbers(&resource);
+    for (int i = 0; i < 1000; ++i)
+    {
+        numbers.push_back(i);
+    }
+    numbers.remove_if([](int i)
+    {
+        return i % 2;
+    });
+    ASSERT_EQUAL(numbers.size(), 500u);
+    ASSERT_EQUAL(numbers.back(), 998);
+
+    pmr::unordered_map<int, pmr::string> names(&resource);
+    for (int i = 0; i < 1000; ++i)
+    {
+        names[i] = pmr::string(to_string(i) + " is a rather long string value", &resource);
+    }
+    for (int i = 0; i < 1000; i += 2)
+    {
+        names.erase(i);
+    }
+    ASSERT_EQUAL(names.size(), 500u);
+    ASSERT_EQUAL(names.at(7), "7 is a rather long string value");
+
+    {
+        LOG_DURATION("std::list");
+        list<int> l;
+        for (int round = 0; round < 100; ++round)
+        {
+            for (int i = 0; i < 10000; ++i)
+            {
+                l.push_back(i);
+            }
+            l.clear();
+        }
+    }
+    {
+        LOG_DURATION("pmr::list on PoolMemoryResource");
+        pmr::list<int> l(&resource);
+        for (int round = 0; round < 100; ++round)
+        {
+            for (int i = 0; i < 10000; ++i)
+            {
+                l.push_back(i);
+            }
+            l.clear();
+        }
+    }
+}
+
+void TestConcurrentObjectPool()
+{
+    const size_t magazine_size = 16;
+    ConcurrentObjectPool<string> pool(magazine_size);
+
+    auto p1 = pool.Allocate();
+    *p1 = "first";
+    pool.Deallocate(p1);
+    ASSERT_EQUAL(pool.Allocate(), p1);
+
+    // Объекты, выделенные в одном потоке и освобождённые в другом,
+    // снова выдаются пулом, а не создаются заново
+    const size_t object_count = 1000;
+    unordered_set<string *> seen;
+
+    for (int round = 0; round < 10; ++round)
+    {
+        auto objects = async(launch::async, [&pool, object_count]
+        {
+            vector<string *> result;
+            for (size_t i = 0; i < object_count; ++i)
+            {
+                result.push_back(pool.Allocate());
+            }
+            return result;
+        }).get();
+
+        seen.insert(objects.begin(), objects.end());
+
+        async(launch::async, [&pool, &objects]
+        {
+            for (auto p : objects)
+            {
+                pool.Deallocate(p);
+            }
+        }).get();
+    }
+
+    // Магазины завершившихся потоков вернулись на склад, поэтому каждый
+    // раунд получает те же объекты, а новые создаются только с точностью
+    // до одного неполного магазина
+    ASSERT(seen.size() <= object_count + magazine_size);
+    ASSERT(pool.DepotSize() >= seen.size());
+
+    const bool reused = async(launch::async, [&pool, &seen, object_count]
+    {
+        for (size_t i = 0; i < object_count; ++i)
+        {
+            if (!seen.count(pool.Allocate()))
+            {
+                return false;
+            }
+        }
+        return true;
+    }).get();
+    ASSERT(reused);
+
+    string local;
+    ObjectPool<string> other_pool;
+    for (string *foreign : {&local, other_pool.Allocate()})
+    {
+        bool thrown = false;
+        try
+        {
+            pool.Deallocate(foreign);
+        }
+        catch (invalid_argument &)
+        {
+            thrown = true;
+        }
+        ASSERT(thrown);
+    }
+}
+
+void TestConcurrentWrongDeallocation()
+{
+    ConcurrentObjectPool<string> pool;
+
+    auto expectThrow = [&pool](string *object)
+    {
+        bool thrown = false;
+        try
+        {
+            pool.Deallocate(object);
+        }
+        catch (invalid_argument &)
+        {
+            thrown = true;
+        }
+        ASSERT(thrown);
+    };
+
+    // Магазин ещё не видел ни одного блока
+    expectThrow(nullptr);
+
+    auto p1 = pool.Allocate();
+    auto p2 = pool.Allocate();
+    pool.Deallocate(p2);
+
+    // Последний блок магазина теперь блок p1, но адрес не начало объекта
+    expectThrow(reinterpret_cast<string *>(reinterpret_cast<char *>(p1) + 1));
+    expectThrow(nullptr);
+
+    pool.Deallocate(p1);
+}
+
+void TestConcurrentSpeed()
+{
+    const size_t thread_count = 4;
+    const int object_count = 1000;
+    const int round_count = 250;
+
+    auto run = [&](auto allocate, auto deallocate)
+    {
+        vector<future<void>> futures;
+        for (size_t i = 0; i < thread_count; ++i)
+        {
+            futures.push_back(async(launch::async, [&]
+            {
+                vector<string *> objects(object_count);
+                for (int round = 0; round < round_count; ++round)
+                {
+                    for (auto &p : objects)
+                    {
+                        p = allocate();
+                    }
+                    for (auto p : objects)
+                    {
+                        deallocate(p);
+                    }
+                }
+            }));
+        }
+    };
+
+    {
+        LOG_DURATION("ObjectPool under mutex");
+        ObjectPool<string> pool;
+        mutex locker;
+        run([&]
+        {
+            lock_guard<mutex> guard(locker);
+            return pool.Allocate();
+        }, [&](string *p)
+        {
+            lock_guard<mutex> guard(locker);
+            pool.Deallocate(p);
+        });
+    }
+    {
+        LOG_DURATION("ConcurrentObjectPool");
+        ConcurrentObjectPool<string> pool;
+        run([&]
+        {
+            return pool.Allocate();
+        }, [&](string *p)
+        {
+            pool.Deallocate(p);
+        });
+    }
+}
+
 int main()
 {
     TestRunner tr;
     RUN_TEST(tr, TestObjectPool);
+    RUN_TEST(tr, TestWrongDeallocation);
+    RUN_TEST(tr, TestManyObjects);
+    RUN_TEST(tr, TestSpeed);
+    RUN_TEST(tr, TestPooledPtr);
+    RUN_TEST(tr, TestPoolMemoryResource);
+    RUN_TEST(tr, TestConcurrentObjectPool);
+    RUN_TEST(tr, TestConcurrentWrongDeallocation);
+    RUN_TEST(tr, TestConcurrentSpeed);
     return 0;
 }
@@ -1,184 +1,3125 @@
 #include "test_runner.h"
+#include "profile.h"
+#include "mapped_file.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <limits>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <queue>
+#include <random>
+#include <set>
+#include <shared_mutex>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
+// Представление записи. Database копирует строки к себе, а отдаёт записи
+// со ссылками на свою память: они действительны, пока запись не удалена.
 struct Record
 {
-    string id;
-    string title;
-    string user;
+    string_view id;
+    string_view title;
+    string_view user;
     int timestamp;
     int karma;
 };
 
-// Реализуйте этот класс
-class Database
+// Память для строк блоками по BLOCK_SIZE байт. Сохранённые строки
+// не перемещаются, пока их не освободят, поэтому на них можно ссылаться
+// через string_view. Блок возвращается системе, когда освобождены все
+// его строки.
+class StringArena
 {
 public:
-    bool Put(const Record &record)
+    string_view Store(string_view text)
     {
-        auto [it, inserted] = _records.insert(make_pair(record.id, Item {record}));
+        if (text.empty())
+        {
+            return {};
+        }
 
-        if (!inserted)
+        Block *block;
+
+        if (text.size() > BLOCK_SIZE / 4)
         {
-            return false;
+            // Длинная строка получает собственный блок, чтобы не бросать
+            // недозаполненным текущий
+            block = &addBlock(text.size());
         }
+        else
+        {
+            if (_current == nullptr || text.size() > BLOCK_SIZE - _current->used)
+            {
+                Block *previous = _current;
+                _current = &addBlock(BLOCK_SIZE);
 
-        updateIndexes(it);
-        return true;
+                if (previous != nullptr && previous->live == 0)
+                {
+                    removeBlock(previous->start());
+                }
+            }
+
+            block = _current;
+        }
+
+        char *data = block->data.get() + block->used;
+        block->used += text.size();
+        block->live += text.size();
+        copy(text.begin(), text.end(), data);
+        return {data, text.size()};
     }
 
-    const Record *GetById(const string &id) const
+    // Освобождает строку, полученную от Store. Строки не из арены,
+    // например из отображённого снимка, пропускаются.
+    void Release(string_view text)
     {
-        auto it = _records.find(id);
+        if (text.empty())
+        {
+            return;
+        }
+
+        const uintptr_t address = reinterpret_cast<uintptr_t>(text.data());
+        auto it = _blocks.upper_bound(address);
 
-        if (it == _records.end())
+        if (it == _blocks.begin() || address >= prev(it)->first + prev(it)->second.size)
         {
-            return nullptr;
+            return;
+        }
+
+        Block &block = prev(it)->second;
+        block.live -= text.size();
+
+        if (block.live == 0 && &block != _current)
+        {
+            removeBlock(prev(it)->first);
         }
+    }
 
-        return &it->second.record;
+    size_t Bytes() const
+    {
+        return _bytes + _blocks.size() * (sizeof(pair<uintptr_t, Block>) + 4 * sizeof(void *));
     }
 
-    bool Erase(const string &id)
+private:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    struct Block
     {
-        auto it = _records.find(id);
+        unique_ptr<char[]> data;
+        size_t size;
+        size_t used = 0;
+        size_t live = 0;
 
-        if (it == _records.end())
+        uintptr_t start() const
         {
-            return false;
+            return reinterpret_cast<uintptr_t>(data.get());
         }
+    };
 
-        eraseFromIndexes(it->second);
-        _records.erase(it);
-        return true;
+    // Блоки по адресу начала, чтобы найти блок освобождаемой строки
+    map<uintptr_t, Block> _blocks;
+    Block *_current = nullptr;
+    size_t _bytes = 0;
+
+    Block &addBlock(size_t size)
+    {
+        Block block{make_unique<char[]>(size), size};
+        const uintptr_t start = block.start();
+        _bytes += size;
+        return _blocks.emplace(start, move(block)).first->second;
     }
 
-    template <typename Callback>
-    void RangeByTimestamp(int low, int high, Callback callback) const
+    void removeBlock(uintptr_t start)
     {
-        rangeCallback(_byTs, low, high, callback);
+        auto it = _blocks.find(start);
+        _bytes -= it->second.size;
+        _blocks.erase(it);
     }
+};
 
-    template <typename Callback>
-    void RangeByKarma(int low, int high, Callback callback) const
+// Массив с доступом по номеру, растущий блоками по CHUNK_SIZE элементов.
+// В отличие от vector добавление не перемещает уже лежащие элементы.
+template <typename T>
+class StableArray
+{
+public:
+    T &operator[](size_t i)
     {
-        rangeCallback(_byKarma, low, high, callback);
+        return _chunks[i / CHUNK_SIZE][i % CHUNK_SIZE];
     }
 
-    template <typename Callback>
-    void AllByUser(const string &user, Callback callback) const
+    const T &operator[](size_t i) const
+    {
+        return _chunks[i / CHUNK_SIZE][i % CHUNK_SIZE];
+    }
+
+    void push_back(const T &value)
+    {
+        if (_size == _chunks.size() * CHUNK_SIZE)
+        {
+            _chunks.push_back(make_unique<T[]>(CHUNK_SIZE));
+        }
+
+        (*this)[_size++] = value;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
     {
-        applyCallback(_byUser.equal_range(user), callback);
+        return _size == 0;
+    }
+
+    size_t Bytes() const
+    {
+        return _chunks.size() * CHUNK_SIZE * sizeof(T) + _chunks.capacity() * sizeof(_chunks[0]);
     }
 
 private:
-    template <typename T>
-    using Index = multimap<T, const Record *>;
+    static constexpr size_t CHUNK_SIZE = 1024;
+
+    vector<unique_ptr<T[]>> _chunks;
+    size_t _size = 0;
+};
+
+// Интернированные строки: каждая хранится один раз и заменяется номером
+class StringPool
+{
+public:
+    static constexpr uint32_t NOT_FOUND = numeric_limits<uint32_t>::max();
 
-    struct Item
+    uint32_t Intern(string_view text)
     {
-        Record record;
-        Index<string>::iterator userIt;
-        Index<int>::iterator tsIt;
-        Index<int>::iterator karmaIt;
-    };
+        auto it = _ids.find(text);
+
+        if (it != _ids.end())
+        {
+            return it->second;
+        }
+
+        const string_view stored = _arena.Store(text);
+        _strings.push_back(stored);
+        _ids.emplace(stored, _strings.size() - 1);
+        return _strings.size() - 1;
+    }
+
+    uint32_t Find(string_view text) const
+    {
+        auto it = _ids.find(text);
+        return it == _ids.end() ? NOT_FOUND : it->second;
+    }
+
+    string_view Get(uint32_t id) const
+    {
+        return _strings[id];
+    }
+
+    size_t Size() const
+    {
+        return _strings.size();
+    }
+
+    size_t Bytes() const
+    {
+        return _arena.Bytes() + _strings.capacity() * sizeof(string_view)
+            + _ids.bucket_count() * sizeof(void *)
+            + _ids.size() * (sizeof(pair<string_view, uint32_t>) + 2 * sizeof(void *));
+    }
 
-    unordered_map<string, Item> _records;
-    Index<string> _byUser;
-    Index<int> _byTs;
-    Index<int> _byKarma;
+private:
+    StringArena _arena;
+    vector<string_view> _strings;
+    unordered_map<string_view, uint32_t> _ids;
+};
+
+// Индекс на отсортированных массивах. Основной массив пар (ключ, запись)
+// строится сортировкой при массовой загрузке или слиянием, а одиночные
+// вставки попадают в небольшую дельту. Пары упорядочены целиком, так что
+// запись с известным ключом находится двоичным поиском. Удалённые записи не вычищаются
+// сразу: обход пропускает их, а Merge удаляет окончательно.
+template <typename Key>
+class SortedIndex
+{
+public:
+    using Entry = pair<Key, uint32_t>;
 
-    template <typename Iterator>
-    void updateIndexes(Iterator it)
+    void Insert(const Key &key, uint32_t handle)
     {
-        Item &item = it->second;
-        const Record *pRecord = &item.record;
-        item.userIt = _byUser.insert({pRecord->user, pRecord});
-        item.tsIt = _byTs.insert({pRecord->timestamp, pRecord});
-        item.karmaIt = _byKarma.insert({pRecord->karma, pRecord});
+        _delta.emplace(key, handle);
     }
 
-    void eraseFromIndexes(const Item &item)
+    void BulkInsert(vector<Entry> entries)
     {
-        _byUser.erase(item.userIt);
-        _byTs.erase(item.tsIt);
-        _byKarma.erase(item.karmaIt);
+        sort(entries.begin(), entries.end());
+
+        if (_main.empty())
+        {
+            _main = move(entries);
+            return;
+        }
+
+        vector<Entry> merged;
+        merged.reserve(_main.size() + entries.size());
+        merge(make_move_iterator(_main.begin()), make_move_iterator(_main.end()),
+              make_move_iterator(entries.begin()), make_move_iterator(entries.end()),
+              back_inserter(merged));
+        _main = move(merged);
     }
 
-    template <typename Pair, typename Callback>
-    void applyCallback(const Pair &range, Callback callback) const
+    template <typename IsAlive>
+    void Merge(IsAlive alive)
     {
-        for (auto it = range.first; it != range.second; ++it)
+        vector<Entry> merged;
+        merged.reserve(_main.size() + _delta.size());
+
+        walk(_main.begin(), _main.end(), _delta.begin(), _delta.end(), [&](const auto &entry)
         {
-            if (!callback(*it->second))
+            if (alive(entry.second))
             {
-                return;
+                merged.emplace_back(entry.first, entry.second);
             }
+            return true;
+        });
+
+        _main = move(merged);
+        _delta.clear();
+    }
+
+    // Вызывает callback(handle, key) для живых записей с ключами из [low, high]
+    // в порядке ключей. Возвращает false, если callback прервал обход.
+    template <typename IsAlive, typename Callback>
+    bool ForRange(const Key &low, const Key &high, IsAlive alive, Callback callback) const
+    {
+        auto [first, last] = MainBounds(low, high);
+
+        return walk(_main.begin() + first, _main.begin() + last,
+                    deltaLowerBound(low), deltaUpperBound(high), [&](const auto &entry)
+        {
+            return !alive(entry.second) || callback(entry.second, entry.first);
+        });
+    }
+
+    // Границы [first, last) записей основного массива с ключами из [low, high]
+    pair<size_t, size_t> MainBounds(const Key &low, const Key &high) const
+    {
+        auto first = lower_bound(_main.begin(), _main.end(), low, [](const Entry &entry, const Key &key)
+        {
+            return entry.first < key;
+        });
+        auto last = upper_bound(first, _main.end(), high, [](const Key &key, const Entry &entry)
+        {
+            return key < entry.first;
+        });
+
+        return {first - _main.begin(), last - _main.begin()};
+    }
+
+    // Позиция записи в основном массиве или NOT_IN_MAIN, если она в дельте
+    size_t FindInMain(const Key &key, uint32_t handle) const
+    {
+        const Entry entry{key, handle};
+        auto it = lower_bound(_main.begin(), _main.end(), entry);
+
+        return it != _main.end() && *it == entry ? it - _main.begin() : NOT_IN_MAIN;
+    }
+
+    const vector<Entry> &Main() const
+    {
+        return _main;
+    }
+
+    // Заменяет содержимое уже отсортированным массивом без сортировки
+    void AssignSorted(vector<Entry> entries)
+    {
+        _main = move(entries);
+        _delta.clear();
+    }
+
+    template <typename Callback>
+    void ForDeltaRange(const Key &low, const Key &high, Callback callback) const
+    {
+        for (auto it = deltaLowerBound(low), last = deltaUpperBound(high); it != last; ++it)
+        {
+            callback(it->second);
         }
     }
 
-    template <typename Container, typename Callback, typename Value>
-    void rangeCallback(const Container &c, const Value &low, const Value &high, Callback callback) const
+    static constexpr size_t NOT_IN_MAIN = numeric_limits<size_t>::max();
+
+    size_t DeltaSize() const
+    {
+        return _delta.size();
+    }
+
+    // Оценка занимаемой памяти: узел дерева дельты — это запись и три указателя с цветом
+    size_t Bytes() const
+    {
+        return _main.capacity() * sizeof(Entry) + _delta.size() * (sizeof(Entry) + 4 * sizeof(void *));
+    }
+
+private:
+    vector<Entry> _main;
+    set<Entry> _delta;
+
+    auto deltaLowerBound(const Key &low) const
+    {
+        return _delta.lower_bound({low, 0});
+    }
+
+    auto deltaUpperBound(const Key &high) const
+    {
+        return _delta.upper_bound({high, numeric_limits<uint32_t>::max()});
+    }
+
+    // Обход двух отсортированных по ключу диапазонов в общем порядке
+    template <typename MainIt, typename DeltaIt, typename Visit>
+    static bool walk(MainIt m, MainIt mEnd, DeltaIt d, DeltaIt dEnd, Visit visit)
     {
-        auto first = c.lower_bound(low);
-        auto last = c.upper_bound(high);
-        applyCallback(make_pair(first, last), callback);
+        while (m != mEnd || d != dEnd)
+        {
+            const bool fromMain = d == dEnd || (m != mEnd && *m < *d);
+
+            if (!(fromMain ? visit(*m++) : visit(*d++)))
+            {
+                return false;
+            }
+        }
+
+        return true;
     }
 };
 
-void TestRangeBoundaries()
+// Дополнение основного массива индекса по времени: деревья Фенвика
+// с числом живых записей и суммой их кармы по позициям и дерево отрезков
+// с позицией максимальной кармы. Строится за O(n) после слияния,
+// удаление записи и запросы по отрезку позиций стоят O(log n).
+class KarmaAggregates
 {
-    const int good_karma = 1000;
-    const int bad_karma = -10;
+public:
+    void Build(vector<int> karma, const vector<bool> &alive)
+    {
+        const size_t n = karma.size();
+        _karma = move(karma);
+        _count.assign(n + 1, 0);
+        _sum.assign(n + 1, 0);
 
-    Database db;
-    db.Put({"id1", "Hello there", "master", 1536107260, good_karma});
-    db.Put({"id2", "O>>-<", "general2", 1536107260, bad_karma});
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (!alive[i])
+            {
+                _karma[i] = DEAD;
+                continue;
+            }
 
-    int count = 0;
-    db.RangeByKarma(bad_karma, good_karma, [&count](const Record &)
+            _count[i + 1] += 1;
+            _sum[i + 1] += _karma[i];
+        }
+
+        for (size_t i = 1; i <= n; ++i)
+        {
+            const size_t parent = i + (i & -i);
+
+            if (parent <= n)
+            {
+                _count[parent] += _count[i];
+                _sum[parent] += _sum[i];
+            }
+        }
+
+        _tree.assign(2 * n, 0);
+        for (size_t i = 0; i < n; ++i)
+        {
+            _tree[n + i] = i;
+        }
+        for (size_t i = n; i-- > 1;)
+        {
+            _tree[i] = better(_tree[2 * i], _tree[2 * i + 1]);
+        }
+    }
+
+    void Remove(size_t pos)
     {
-        ++count;
-        return true;
-    });
+        if (_karma[pos] == DEAD)
+        {
+            return;
+        }
 
-    ASSERT_EQUAL(2, count);
-}
+        for (size_t i = pos + 1; i < _count.size(); i += i & -i)
+        {
+            _count[i] -= 1;
+            _sum[i] -= _karma[pos];
+        }
 
-void TestSameUser()
-{
-    Database db;
-    db.Put({"id1", "Don't sell", "master", 1536107260, 1000});
-    db.Put({"id2", "Rethink life", "master", 1536107260, 2000});
+        _karma[pos] = DEAD;
 
-    int count = 0;
-    db.AllByUser("master", [&count](const Record &)
+        const size_t n = _karma.size();
+        for (size_t i = (n + pos) / 2; i > 0; i /= 2)
+        {
+            _tree[i] = better(_tree[2 * i], _tree[2 * i + 1]);
+        }
+    }
+
+    size_t Count(size_t first, size_t last) const
     {
-        ++count;
-        return true;
-    });
+        return prefix(_count, last) - prefix(_count, first);
+    }
 
-    ASSERT_EQUAL(2, count);
-}
+    long long Sum(size_t first, size_t last) const
+    {
+        return prefix(_sum, last) - prefix(_sum, first);
+    }
 
-void TestReplacement()
+    size_t Bytes() const
+    {
+        return _karma.capacity() * sizeof(int) + _count.capacity() * sizeof(int)
+            + _sum.capacity() * sizeof(long long) + _tree.capacity() * sizeof(size_t);
+    }
+
+    // Позиция живой записи с максимальной кармой в [first, last) или last
+    size_t ArgMax(size_t first, size_t last) const
+    {
+        const size_t n = _karma.size();
+        size_t result = n;
+
+        for (size_t l = first + n, r = last + n; l < r; l /= 2, r /= 2)
+        {
+            if (l & 1)
+            {
+                result = better(result, _tree[l++]);
+            }
+            if (r & 1)
+            {
+                result = better(result, _tree[--r]);
+            }
+        }
+
+        return result < n && _karma[result] != DEAD ? result : last;
+    }
+
+private:
+    static constexpr int DEAD = numeric_limits<int>::min();
+
+    vector<int> _karma;
+    vector<int> _count;
+    vector<long long> _sum;
+    vector<size_t> _tree;
+
+    // Позиция за пределами массива проигрывает любой настоящей
+    size_t better(size_t lhs, size_t rhs) const
+    {
+        if (lhs >= _karma.size())
+        {
+            return rhs;
+        }
+        if (rhs >= _karma.size())
+        {
+            return lhs;
+        }
+
+        return _karma[rhs] > _karma[lhs] ? rhs : lhs;
+    }
+
+    template <typename T>
+    static T prefix(const vector<T> &tree, size_t last)
+    {
+        T result = 0;
+
+        for (size_t i = last; i > 0; i -= i & -i)
+        {
+            result += tree[i];
+        }
+
+        return result;
+    }
+};
+
+// Файл для записи поверх дескриптора: запись без буферизации и сброс на диск
+class OutputFile
 {
-    const string final_body = "Feeling sad";
+public:
+    OutputFile(const string &path, int flags)
+        : _path(path)
+        , _fd(::open(path.c_str(), flags, 0644))
+    {
+        if (_fd < 0)
+        {
+            fail();
+        }
+    }
 
-    Database db;
-    db.Put({"id", "Have a hand", "not-master", 1536107260, 10});
-    db.Erase("id");
-    db.Put({"id", final_body, "not-master", 1536107260, -10});
+    OutputFile(const OutputFile &) = delete;
+    OutputFile &operator=(const OutputFile &) = delete;
 
-    auto record = db.GetById("id");
-    ASSERT(record != nullptr);
-    ASSERT_EQUAL(final_body, record->title);
+    ~OutputFile()
+    {
+        ::close(_fd);
+    }
+
+    void Write(string_view data)
+    {
+        while (!data.empty())
+        {
+            const ssize_t written = ::write(_fd, data.data(), data.size());
+
+            if (written < 0 && errno != EINTR)
+            {
+                fail();
+            }
+
+            data.remove_prefix(max<ssize_t>(written, 0));
+        }
+    }
+
+    template <typename T>
+    void WriteArray(const vector<T> &values)
+    {
+        Write({reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T)});
+    }
+
+    void Sync()
+    {
+        if (::fdatasync(_fd) < 0)
+        {
+            fail();
+        }
+    }
+
+    void Truncate(size_t size)
+    {
+        if (::ftruncate(_fd, size) < 0)
+        {
+            fail();
+        }
+    }
+
+private:
+    const string _path;
+    const int _fd;
+
+    [[noreturn]] void fail() const
+    {
+        throw system_error(errno, generic_category(), _path);
+    }
+};
+
+// Сбрасывает на диск сам каталог, чтобы созданные и переименованные
+// в нём файлы пережили сбой
+void SyncDirectory(const filesystem::path &directory)
+{
+    const string path = directory.empty() ? "." : directory.string();
+    const int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY);
+
+    if (fd < 0 || ::fsync(fd) < 0)
+    {
+        const int error = errno;
+
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+
+        throw system_error(error, generic_category(), path);
+    }
+
+    ::close(fd);
+}
+
+// Записи хранятся в StableArray и адресуются номерами, индексы — в SortedIndex.
+// Строки записи лежат подряд в арене и не перемещаются, пока запись жива,
+// пользователи интернированы, так что индексы содержат только числа.
+// Put и Erase копят изменения в дельтах индексов и сливают их с основными
+// массивами, когда изменений набирается больше MIN_PENDING и восьмой
+// части базы, так что слияние стоит O(1) на изменение; освобождённые номера
+// записей переиспользуются только после слияния, когда на них
+// не ссылается ни один индекс.
+class Database
+{
+    using UserKey = pair<uint32_t, int>;
+
+public:
+    bool Put(const Record &record)
+    {
+        if (_byId.count(record.id))
+        {
+            return false;
+        }
+
+        const uint32_t handle = allocate(record);
+        const uint32_t user = _records[handle].user;
+        _byId.emplace(idOf(handle), handle);
+        _byUserTs.Insert({user, record.timestamp}, handle);
+        _byUserKarma.Insert({user, record.karma}, handle);
+        _byTs.Insert(record.timestamp, handle);
+        _byKarma.Insert(record.karma, handle);
+        changed();
+        return true;
+    }
+
+    // Массовая загрузка: индексы строятся одной сортировкой, а не вставками.
+    // Записи с уже существующими id пропускаются. Возвращает число
+    // добавленных записей.
+    template <typename InputIt>
+    size_t BulkLoad(InputIt first, InputIt last)
+    {
+        vector<SortedIndex<UserKey>::Entry> byUserTs;
+        vector<SortedIndex<UserKey>::Entry> byUserKarma;
+        vector<SortedIndex<int>::Entry> byTs;
+        vector<SortedIndex<int>::Entry> byKarma;
+
+        for (; first != last; ++first)
+        {
+            const Record &record = *first;
+
+            if (_byId.count(record.id))
+            {
+                continue;
+            }
+
+            const uint32_t handle = allocate(record);
+            const uint32_t user = _records[handle].user;
+            _byId.emplace(idOf(handle), handle);
+            byUserTs.push_back({{user, record.timestamp}, handle});
+            byUserKarma.push_back({{user, record.karma}, handle});
+            byTs.emplace_back(record.timestamp, handle);
+            byKarma.emplace_back(record.karma, handle);
+        }
+
+        const size_t added = byTs.size();
+        _byUserTs.BulkInsert(move(byUserTs));
+        _byUserKarma.BulkInsert(move(byUserKarma));
+        _byTs.BulkInsert(move(byTs));
+        _byKarma.BulkInsert(move(byKarma));
+        rebuildAggregates();
+        return added;
+    }
+
+    // Живая запись с номером handle или nullptr. Обходы по диапазону
+    // вызывают callback(handle, key) вместо callback(record), если он так
+    // объявлен: номер записи и значение ключа (время или карма) берутся
+    // из индекса, и сама запись не читается. Номер остаётся за записью,
+    // пока она не удалена.
+    const Record *GetByHandle(uint32_t handle) const
+    {
+        return handle < _records.size() && _alive[handle] ? &view(handle) : nullptr;
+    }
+
+    const Record *GetById(string_view id) const
+    {
+        auto it = _byId.find(id);
+
+        if (it == _byId.end())
+        {
+            return nullptr;
+        }
+
+        return &view(it->second);
+    }
+
+    bool Erase(string_view id)
+    {
+        auto it = _byId.find(id);
+
+        if (it == _byId.end())
+        {
+            return false;
+        }
+
+        const uint32_t handle = it->second;
+        const Record &record = view(handle);
+        const size_t tsPos = _byTs.FindInMain(record.timestamp, handle);
+
+        if (tsPos != SortedIndex<int>::NOT_IN_MAIN)
+        {
+            _tsAggregates.Remove(tsPos);
+        }
+
+        _byId.erase(it);
+        _textBytes -= record.id.size() + record.title.size();
+        _text.Release({record.id.data(), record.id.size() + record.title.size()});
+        _alive[handle] = false;
+        _erased.push_back(handle);
+        changed();
+        return true;
+    }
+
+    template <typename Callback>
+    void RangeByTimestamp(int low, int high, Callback callback) const
+    {
+        rangeCallback(_byTs, low, high, callback);
+    }
+
+    template <typename Callback>
+    void RangeByKarma(int low, int high, Callback callback) const
+    {
+        rangeCallback(_byKarma, low, high, callback);
+    }
+
+    // Записи пользователя в порядке времени
+    template <typename Callback>
+    void AllByUser(string_view user, Callback callback) const
+    {
+        RangeByUserAndTimestamp(user, numeric_limits<int>::min(), numeric_limits<int>::max(), callback);
+    }
+
+    // Составные индексы (пользователь, время) и (пользователь, карма)
+    // позволяют сразу найти нужный отрезок записей пользователя,
+    // не перебирая все его записи
+    template <typename Callback>
+    void RangeByUserAndTimestamp(string_view user, int low, int high, Callback callback) const
+    {
+        const uint32_t id = _users.Find(user);
+
+        if (id != StringPool::NOT_FOUND)
+        {
+            rangeCallback(_byUserTs, UserKey{id, low}, UserKey{id, high}, callback);
+        }
+    }
+
+    template <typename Callback>
+    void RangeByUserAndKarma(string_view user, int low, int high, Callback callback) const
+    {
+        const uint32_t id = _users.Find(user);
+
+        if (id != StringPool::NOT_FOUND)
+        {
+            rangeCallback(_byUserKarma, UserKey{id, low}, UserKey{id, high}, callback);
+        }
+    }
+
+    size_t CountByUserAndTimestamp(string_view user, int low, int high) const
+    {
+        size_t result = 0;
+        RangeByUserAndTimestamp(user, low, high, [&result](const Record &)
+        {
+            ++result;
+            return true;
+        });
+        return result;
+    }
+
+    // Агрегаты по окну времени считаются по дополненному основному массиву
+    // за O(log n); ещё не слитые в него записи дельты досматриваются отдельно
+
+    size_t CountByTimestamp(int low, int high) const
+    {
+        auto [first, last] = _byTs.MainBounds(low, high);
+        size_t result = _tsAggregates.Count(first, last);
+
+        _byTs.ForDeltaRange(low, high, [this, &result](uint32_t handle)
+        {
+            result += _alive[handle];
+        });
+
+        return result;
+    }
+
+    long long KarmaSumByTimestamp(int low, int high) const
+    {
+        auto [first, last] = _byTs.MainBounds(low, high);
+        long long result = _tsAggregates.Sum(first, last);
+
+        _byTs.ForDeltaRange(low, high, [this, &result](uint32_t handle)
+        {
+            if (_alive[handle])
+            {
+                result += view(handle).karma;
+            }
+        });
+
+        return result;
+    }
+
+    // До k записей окна времени с наибольшей кармой, по убыванию кармы.
+    // Отрезки основного массива перебираются через кучу по максимуму
+    // на отрезке, что стоит O(k log n).
+    vector<Record> TopByKarma(int low, int high, size_t k) const
+    {
+        vector<Record> result;
+
+        _byTs.ForDeltaRange(low, high, [this, &result](uint32_t handle)
+        {
+            if (_alive[handle])
+            {
+                result.push_back(view(handle));
+            }
+        });
+
+        const auto &main = _byTs.Main();
+        auto [first, last] = _byTs.MainBounds(low, high);
+
+        struct Segment
+        {
+            size_t top, first, last;
+            int karma;
+
+            bool operator<(const Segment &other) const
+            {
+                return karma < other.karma;
+            }
+        };
+
+        priority_queue<Segment> segments;
+        auto push = [&](size_t first, size_t last)
+        {
+            const size_t top = _tsAggregates.ArgMax(first, last);
+
+            if (top != last)
+            {
+                segments.push({top, first, last, view(main[top].second).karma});
+            }
+        };
+
+        push(first, last);
+        for (size_t taken = 0; taken < k && !segments.empty(); ++taken)
+        {
+            const Segment segment = segments.top();
+            segments.pop();
+            result.push_back(view(main[segment.top].second));
+            push(segment.first, segment.top);
+            push(segment.top + 1, segment.last);
+        }
+
+        auto byKarma = [](const Record &lhs, const Record &rhs)
+        {
+            return lhs.karma > rhs.karma;
+        };
+
+        const size_t count = min(k, result.size());
+        partial_sort(result.begin(), result.begin() + count, result.end(), byKarma);
+        result.resize(count);
+        return result;
+    }
+
+    // Делит окно времени на thread_count частей и обходит их параллельно.
+    // callback(const Record &) вызывается одновременно из разных потоков
+    // и не может прервать обход.
+    template <typename Callback>
+    void ParallelRangeByTimestamp(int low, int high, Callback callback, size_t thread_count) const
+    {
+        const auto &main = _byTs.Main();
+        auto [first, last] = _byTs.MainBounds(low, high);
+        thread_count = max<size_t>(thread_count, 1);
+        const size_t chunk = (last - first + thread_count - 1) / thread_count;
+
+        vector<future<void>> futures;
+        for (size_t begin = first; begin < last; begin += chunk)
+        {
+            const size_t end = min(begin + chunk, last);
+
+            futures.push_back(async(launch::async, [this, &main, &callback, begin, end]
+            {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    if (_alive[main[i].second])
+                    {
+                        callback(view(main[i].second));
+                    }
+                }
+            }));
+        }
+
+        _byTs.ForDeltaRange(low, high, [this, &callback](uint32_t handle)
+        {
+            if (_alive[handle])
+            {
+                callback(view(handle));
+            }
+        });
+    }
+
+    // Сливает дельты индексов с основными массивами
+    void Compact()
+    {
+        auto alive = [this](uint32_t handle)
+        {
+            return _alive[handle];
+        };
+
+        _byUserTs.Merge(alive);
+        _byUserKarma.Merge(alive);
+        _byTs.Merge(alive);
+        _byKarma.Merge(alive);
+        rebuildAggregates();
+
+        _free.insert(_free.end(), _erased.begin(), _erased.end());
+        _erased.clear();
+        _pending = 0;
+    }
+
+    // Снимок базы: записи, строки и порядок записей в каждом индексе, так что
+    // загрузка не сортирует. Записи перенумеровываются подряд без удалённых.
+    // Снимок пишется во временный файл и атомарно заменяет path, поэтому
+    // на диске всегда лежит целый снимок, а отображение прежнего файла,
+    // в том числе загруженного этой базой, остаётся действительным.
+    void SaveSnapshot(const string &path)
+    {
+        Compact();
+
+        vector<uint32_t> renumbered(_records.size());
+        vector<SnapshotRecord> records;
+        string text;
+        text.reserve(_textBytes);
+
+        for (uint32_t handle = 0; handle < _records.size(); ++handle)
+        {
+            if (_alive[handle])
+            {
+                const StoredRecord &stored = _records[handle];
+                const Record &record = stored.record;
+                renumbered[handle] = records.size();
+                records.push_back({text.size(), static_cast<uint32_t>(record.id.size()),
+                                   static_cast<uint32_t>(record.title.size()),
+                                   stored.user, record.timestamp, record.karma});
+                text.append(record.id);
+                text.append(record.title);
+            }
+        }
+
+        auto order = [&renumbered](const auto &index)
+        {
+            vector<uint32_t> result;
+            result.reserve(index.Main().size());
+
+            for (const auto &entry : index.Main())
+            {
+                result.push_back(renumbered[entry.second]);
+            }
+
+            return result;
+        };
+
+        vector<uint32_t> userSizes;
+        string userText;
+
+        for (uint32_t user = 0; user < _users.Size(); ++user)
+        {
+            userSizes.push_back(_users.Get(user).size());
+            userText.append(_users.Get(user));
+        }
+
+        SnapshotHeader header{};
+        copy(begin(SNAPSHOT_MAGIC), end(SNAPSHOT_MAGIC), header.magic);
+        header.recordCount = records.size();
+        header.userCount = userSizes.size();
+        header.userTextSize = userText.size();
+        header.textSize = text.size();
+
+        const string temporary = path + ".tmp";
+        {
+            OutputFile file(temporary, O_WRONLY | O_CREAT | O_TRUNC);
+            file.Write({reinterpret_cast<const char *>(&header), sizeof(header)});
+            file.WriteArray(records);
+            file.WriteArray(order(_byUserTs));
+            file.WriteArray(order(_byUserKarma));
+            file.WriteArray(order(_byTs));
+            file.WriteArray(order(_byKarma));
+            file.WriteArray(userSizes);
+            file.Write(userText);
+            file.Write(text);
+            file.Sync();
+        }
+
+        filesystem::rename(temporary, path);
+        SyncDirectory(filesystem::path(path).parent_path());
+    }
+
+    // Загружает снимок в пустую базу. Файл отображается в память, и строки
+    // записей остаются в отображении, а не копируются. Снимок сначала
+    // целиком проверяется и только потом переносится в базу, так что
+    // при ошибке база остаётся пустой.
+    void LoadSnapshot(const string &path)
+    {
+        if (!_records.empty())
+        {
+            throw logic_error("snapshot can be loaded only into an empty database");
+        }
+
+        MappedFile file(path);
+        auto corrupted = [&path]
+        {
+            return runtime_error("corrupted snapshot " + path);
+        };
+
+        if (file.Size() < sizeof(SnapshotHeader))
+        {
+            throw corrupted();
+        }
+
+        const auto &header = *reinterpret_cast<const SnapshotHeader *>(file.Data());
+        const size_t n = header.recordCount;
+        size_t rest = file.Size() - sizeof(header);
+
+        // Откусывает count элементов по unit байт от оставшейся части файла
+        auto take = [&rest](uint64_t count, size_t unit)
+        {
+            if (count > rest / unit)
+            {
+                return false;
+            }
+
+            rest -= count * unit;
+            return true;
+        };
+
+        if (!equal(begin(SNAPSHOT_MAGIC), end(SNAPSHOT_MAGIC), header.magic)
+            || !take(header.recordCount, sizeof(SnapshotRecord) + 4 * sizeof(uint32_t))
+            || !take(header.userCount, sizeof(uint32_t)) || !take(header.userTextSize, 1)
+            || !take(header.textSize, 1) || rest != 0)
+        {
+            throw corrupted();
+        }
+
+        const auto *records = reinterpret_cast<const SnapshotRecord *>(file.Data() + sizeof(header));
+        const auto *orders = reinterpret_cast<const uint32_t *>(records + n);
+        const auto *userSizes = orders + 4 * n;
+        const char *userText = reinterpret_cast<const char *>(userSizes + header.userCount);
+        const char *text = userText + header.userTextSize;
+
+        vector<string_view> users;
+        users.reserve(header.userCount);
+        unordered_map<string_view, uint32_t> userIds;
+        uint64_t userOffset = 0;
+
+        for (size_t user = 0; user < header.userCount; ++user)
+        {
+            if (userSizes[user] > header.userTextSize - userOffset)
+            {
+                throw corrupted();
+            }
+
+            users.emplace_back(userText + userOffset, userSizes[user]);
+            userOffset += userSizes[user];
+
+            // Номера пользователей — позиции в _users, поэтому имена не повторяются
+            if (!userIds.emplace(users.back(), user).second)
+            {
+                throw corrupted();
+            }
+        }
+
+        if (userOffset != header.userTextSize)
+        {
+            throw corrupted();
+        }
+
+        unordered_map<string_view, uint32_t> byId;
+        byId.reserve(n);
+
+        for (size_t handle = 0; handle < n; ++handle)
+        {
+            const SnapshotRecord &record = records[handle];
+
+            if (record.textOffset > header.textSize
+                || uint64_t(record.idSize) + record.titleSize > header.textSize - record.textOffset
+                || record.user >= header.userCount
+                || !byId.emplace(string_view(text + record.textOffset, record.idSize), handle).second)
+            {
+                throw corrupted();
+            }
+        }
+
+        auto sorted = [&](const uint32_t *order, auto key)
+        {
+            using Entry = pair<decltype(key(records[0])), uint32_t>;
+            vector<Entry> entries;
+            entries.reserve(n);
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (order[i] >= n)
+                {
+                    throw corrupted();
+                }
+
+                entries.emplace_back(key(records[order[i]]), order[i]);
+            }
+
+            if (!is_sorted(entries.begin(), entries.end()))
+            {
+                throw corrupted();
+            }
+
+            return entries;
+        };
+
+        auto byUserTs = sorted(orders, [](const SnapshotRecord &record)
+        {
+            return UserKey{record.user, record.timestamp};
+        });
+        auto byUserKarma = sorted(orders + n, [](const SnapshotRecord &record)
+        {
+            return UserKey{record.user, record.karma};
+        });
+        auto byTs = sorted(orders + 2 * n, [](const SnapshotRecord &record)
+        {
+            return int(record.timestamp);
+        });
+        auto byKarma = sorted(orders + 3 * n, [](const SnapshotRecord &record)
+        {
+            return int(record.karma);
+        });
+
+        // Дальше снимок уже не может оказаться испорченным
+        for (string_view user : users)
+        {
+            _users.Intern(user);
+        }
+
+        for (size_t handle = 0; handle < n; ++handle)
+        {
+            const SnapshotRecord &record = records[handle];
+            const char *recordText = text + record.textOffset;
+            _records.push_back({{{recordText, record.idSize}, {recordText + record.idSize, record.titleSize},
+                                 _users.Get(record.user), record.timestamp, record.karma}, record.user});
+        }
+
+        _byId = move(byId);
+        _alive.assign(n, true);
+        _textBytes = header.textSize;
+        _byUserTs.AssignSorted(move(byUserTs));
+        _byUserKarma.AssignSorted(move(byUserKarma));
+        _byTs.AssignSorted(move(byTs));
+        _byKarma.AssignSorted(move(byKarma));
+        rebuildAggregates();
+        _snapshot = move(file);
+    }
+
+    size_t Size() const
+    {
+        return _byId.size();
+    }
+
+    // Оценка занимаемой базой памяти в байтах
+    size_t MemoryUsage() const
+    {
+        return _records.Bytes() + _alive.capacity() / 8
+            + (_free.capacity() + _erased.capacity()) * sizeof(uint32_t)
+            + _text.Bytes() + _users.Bytes()
+            + _byId.bucket_count() * sizeof(void *)
+            + _byId.size() * (sizeof(pair<string_view, uint32_t>) + 2 * sizeof(void *))
+            + _byUserTs.Bytes() + _byUserKarma.Bytes() + _byTs.Bytes() + _byKarma.Bytes()
+            + _tsAggregates.Bytes();
+    }
+
+private:
+    static constexpr size_t MIN_PENDING = 4096;
+
+    // Строки записи ссылаются на _text или на отображённый снимок,
+    // id и заголовок лежат подряд. user — номер пользователя в _users.
+    struct StoredRecord
+    {
+        Record record;
+        uint32_t user;
+    };
+
+    static constexpr char SNAPSHOT_MAGIC[8] = {'S', 'I', 'D', 'X', 'S', 'N', 'P', '1'};
+
+    struct SnapshotHeader
+    {
+        char magic[8];
+        uint64_t recordCount;
+        uint64_t userCount;
+        uint64_t userTextSize;
+        uint64_t textSize;
+    };
+
+    struct SnapshotRecord
+    {
+        uint64_t textOffset;
+        uint32_t idSize;
+        uint32_t titleSize;
+        uint32_t user;
+        int32_t timestamp;
+        int32_t karma;
+    };
+
+    // Записи не перемещаются, так что указатели из GetById
+    // остаются действительными, пока запись не удалена
+    StableArray<StoredRecord> _records;
+    vector<bool> _alive;
+    vector<uint32_t> _free;
+    vector<uint32_t> _erased;
+    size_t _pending = 0;
+
+    StringArena _text;
+    MappedFile _snapshot;
+    StringPool _users;
+    string _buffer;
+    size_t _textBytes = 0;
+
+    unordered_map<string_view, uint32_t> _byId;
+    SortedIndex<UserKey> _byUserTs;
+    SortedIndex<UserKey> _byUserKarma;
+    SortedIndex<int> _byTs;
+    SortedIndex<int> _byKarma;
+    KarmaAggregates _tsAggregates;
+
+    void rebuildAggregates()
+    {
+        const auto &main = _byTs.Main();
+        vector<int> karma(main.size());
+        vector<bool> alive(main.size());
+
+        for (size_t i = 0; i < main.size(); ++i)
+        {
+            karma[i] = view(main[i].second).karma;
+            alive[i] = _alive[main[i].second];
+        }
+
+        _tsAggregates.Build(move(karma), alive);
+    }
+
+    const Record &view(uint32_t handle) const
+    {
+        return _records[handle].record;
+    }
+
+    string_view idOf(uint32_t handle) const
+    {
+        return _records[handle].record.id;
+    }
+
+    uint32_t allocate(const Record &record)
+    {
+        _buffer.assign(record.id);
+        _buffer.append(record.title);
+        _textBytes += _buffer.size();
+
+        const char *text = _text.Store(_buffer).data();
+        const uint32_t user = _users.Intern(record.user);
+        const StoredRecord stored{
+            {{text, record.id.size()}, {text + record.id.size(), record.title.size()},
+             _users.Get(user), record.timestamp, record.karma},
+            user
+        };
+
+        if (!_free.empty())
+        {
+            const uint32_t handle = _free.back();
+            _free.pop_back();
+            _records[handle] = stored;
+            _alive[handle] = true;
+            return handle;
+        }
+
+        _records.push_back(stored);
+        _alive.push_back(true);
+        return _records.size() - 1;
+    }
+
+    void changed()
+    {
+        if (++_pending >= max(MIN_PENDING, _byId.size() / 8))
+        {
+            Compact();
+        }
+    }
+
+    template <typename Index, typename Value, typename Callback>
+    void rangeCallback(const Index &index, const Value &low, const Value &high, Callback callback) const
+    {
+        index.ForRange(low, high, [this](uint32_t handle)
+        {
+            return _alive[handle];
+        }, [this, &callback](uint32_t handle, const Value &key)
+        {
+            if constexpr (is_invocable_v<Callback &, uint32_t, int>)
+            {
+                return callback(handle, lastComponent(key));
+            }
+            else
+            {
+                return callback(view(handle));
+            }
+        });
+    }
+
+    static int lastComponent(int key)
+    {
+        return key;
+    }
+
+    static int lastComponent(const UserKey &key)
+    {
+        return key.second;
+    }
+};
+
+// Журнал изменений базы, только дописываемый. Каждая запись журнала —
+// заголовок {размер тела, контрольная сумма} и тело с операцией. Записи
+// копятся в буфере и сбрасываются на диск одним write и fdatasync в Commit.
+// Оборванный или повреждённый хвост журнала отбрасывается при Replay.
+class WriteAheadLog
+{
+public:
+    explicit WriteAheadLog(const string &path)
+        : _path(path)
+        , _file(path, O_WRONLY | O_CREAT | O_APPEND)
+    {
+    }
+
+    void AppendPut(const Record &record)
+    {
+        const size_t start = beginEntry(PUT);
+        appendValue(record.timestamp);
+        appendValue(record.karma);
+        appendString(record.id);
+        appendString(record.title);
+        appendString(record.user);
+        endEntry(start);
+    }
+
+    void AppendErase(string_view id)
+    {
+        const size_t start = beginEntry(ERASE);
+        appendString(id);
+        endEntry(start);
+    }
+
+    size_t PendingCount() const
+    {
+        return _pending;
+    }
+
+    void Commit()
+    {
+        if (_pending == 0)
+        {
+            return;
+        }
+
+        _file.Write(_buffer);
+        _file.Sync();
+        _buffer.clear();
+        _pending = 0;
+    }
+
+    // Применяет записи журнала: on_put(const Record &), on_erase(string_view).
+    // Обрезает файл после последней целой записи и возвращает число записей.
+    template <typename OnPut, typename OnErase>
+    size_t Replay(OnPut on_put, OnErase on_erase)
+    {
+        const MappedFile file(_path);
+        string_view rest = file.View();
+        size_t count = 0;
+
+        while (rest.size() >= HEADER_SIZE)
+        {
+            const auto size = readValue<uint32_t>(rest);
+            const auto sum = readValue<uint32_t>(rest);
+
+            if (size > rest.size() || sum != checksum(rest.substr(0, size)))
+            {
+                break;
+            }
+
+            string_view body = rest.substr(0, size);
+            rest.remove_prefix(size);
+
+            const auto type = readValue<uint8_t>(body);
+
+            if (type == PUT)
+            {
+                Record record;
+                record.timestamp = readValue<int32_t>(body);
+                record.karma = readValue<int32_t>(body);
+                record.id = readString(body);
+                record.title = readString(body);
+                record.user = readString(body);
+                on_put(record);
+            }
+            else
+            {
+                on_erase(readString(body));
+            }
+
+            ++count;
+            _validSize = file.Size() - rest.size();
+        }
+
+        _file.Truncate(_validSize);
+        return count;
+    }
+
+    // Очищает журнал, например после записи снимка
+    void Reset()
+    {
+        _buffer.clear();
+        _pending = 0;
+        _validSize = 0;
+        _file.Truncate(0);
+        _file.Sync();
+    }
+
+private:
+    static constexpr uint8_t PUT = 1;
+    static constexpr uint8_t ERASE = 2;
+    static constexpr size_t HEADER_SIZE = 2 * sizeof(uint32_t);
+
+    const string _path;
+    OutputFile _file;
+    string _buffer;
+    size_t _pending = 0;
+    size_t _validSize = 0;
+
+    size_t beginEntry(uint8_t type)
+    {
+        const size_t start = _buffer.size();
+        _buffer.resize(start + HEADER_SIZE);
+        appendValue(type);
+        return start;
+    }
+
+    void endEntry(size_t start)
+    {
+        const string_view body = string_view(_buffer).substr(start + HEADER_SIZE);
+        const uint32_t header[] = {static_cast<uint32_t>(body.size()), checksum(body)};
+        memcpy(&_buffer[start], header, HEADER_SIZE);
+        ++_pending;
+    }
+
+    template <typename T>
+    void appendValue(T value)
+    {
+        _buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    void appendString(string_view text)
+    {
+        appendValue(static_cast<uint32_t>(text.size()));
+        _buffer.append(text);
+    }
+
+    // Тело уже проверено контрольной суммой, поэтому границы не проверяются
+    template <typename T>
+    static T readValue(string_view &data)
+    {
+        T value;
+        memcpy(&value, data.data(), sizeof(value));
+        data.remove_prefix(sizeof(value));
+        return value;
+    }
+
+    static string_view readString(string_view &data)
+    {
+        const auto size = readValue<uint32_t>(data);
+        const string_view result = data.substr(0, size);
+        data.remove_prefix(size);
+        return result;
+    }
+
+    // FNV-1a
+    static uint32_t checksum(string_view data)
+    {
+        uint32_t result = 2166136261u;
+
+        for (unsigned char c : data)
+        {
+            result = (result ^ c) * 16777619u;
+        }
+
+        return result;
+    }
+};
+
+// База, переживающая перезапуск: изменения пишутся в журнал, а Checkpoint
+// сохраняет снимок и очищает журнал. При открытии загружается снимок
+// и проигрывается журнал. Журнал сбрасывается на диск группами
+// по group_size изменений, а фоновый поток сбрасывает неполную группу
+// через max_delay после первого изменения в ней, поэтому при сбое
+// теряются только изменения последних max_delay.
+class PersistentDatabase
+{
+public:
+    explicit PersistentDatabase(
+        const string &directory, size_t group_size = 256,
+        chrono::milliseconds max_delay = chrono::milliseconds(10)
+    )
+        : _snapshotPath(prepare(directory) + "/snapshot")
+        , _log(directory + "/log")
+        , _groupSize(group_size)
+        , _maxDelay(max_delay)
+    {
+        if (filesystem::exists(_snapshotPath))
+        {
+            _db.LoadSnapshot(_snapshotPath);
+        }
+
+        // Если сбой случился между записью снимка и очисткой журнала,
+        // журнал проигрывается поверх снимка. Последняя операция с каждым
+        // id в журнале определяет итог, поэтому результат тот же.
+        _log.Replay([this](const Record &record)
+        {
+            _db.Put(record);
+        }, [this](string_view id)
+        {
+            _db.Erase(id);
+        });
+
+        _flusher = thread([this] { flushPeriodically(); });
+    }
+
+    PersistentDatabase(const PersistentDatabase &) = delete;
+    PersistentDatabase &operator=(const PersistentDatabase &) = delete;
+
+    ~PersistentDatabase()
+    {
+        {
+            lock_guard<mutex> guard(_logLocker);
+            _stopped = true;
+        }
+        _wakeup.notify_one();
+        _flusher.join();
+
+        try
+        {
+            _log.Commit();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    bool Put(const Record &record)
+    {
+        if (!_db.Put(record))
+        {
+            return false;
+        }
+
+        lock_guard<mutex> guard(_logLocker);
+        _log.AppendPut(record);
+        changed();
+        return true;
+    }
+
+    bool Erase(string_view id)
+    {
+        if (!_db.Erase(id))
+        {
+            return false;
+        }
+
+        lock_guard<mutex> guard(_logLocker);
+        _log.AppendErase(id);
+        changed();
+        return true;
+    }
+
+    // Гарантирует, что все изменения на диске
+    void Commit()
+    {
+        lock_guard<mutex> guard(_logLocker);
+        checkFlushError();
+        _log.Commit();
+    }
+
+    // Журнал очищается только после того, как новый снимок и его запись
+    // в каталоге сброшены на диск
+    void Checkpoint()
+    {
+        lock_guard<mutex> guard(_logLocker);
+        checkFlushError();
+        _log.Commit();
+        _db.SaveSnapshot(_snapshotPath);
+        _log.Reset();
+    }
+
+    const Database &Get() const
+    {
+        return _db;
+    }
+
+private:
+    const string _snapshotPath;
+    WriteAheadLog _log;
+    const size_t _groupSize;
+    const chrono::milliseconds _maxDelay;
+    Database _db;
+
+    // Журнал общий с фоновым потоком, база — нет
+    mutex _logLocker;
+    condition_variable _wakeup;
+    bool _stopped = false;
+    exception_ptr _flushError;
+    thread _flusher;
+
+    static const string &prepare(const string &directory)
+    {
+        filesystem::create_directories(directory);
+        return directory;
+    }
+
+    // Вызывается под _logLocker
+    void changed()
+    {
+        checkFlushError();
+
+        if (_log.PendingCount() >= _groupSize)
+        {
+            _log.Commit();
+        }
+        else if (_log.PendingCount() == 1)
+        {
+            _wakeup.notify_one();
+        }
+    }
+
+    // Ошибка фонового сброса передаётся следующему вызову владельца
+    void checkFlushError()
+    {
+        if (_flushError)
+        {
+            rethrow_exception(exchange(_flushError, nullptr));
+        }
+    }
+
+    void flushPeriodically()
+    {
+        unique_lock<mutex> lock(_logLocker);
+
+        while (!_stopped)
+        {
+            _wakeup.wait(lock, [this] { return _stopped || _log.PendingCount() > 0; });
+
+            if (_stopped || _wakeup.wait_for(lock, _maxDelay, [this] { return _stopped; }))
+            {
+                break;
+            }
+
+            try
+            {
+                _log.Commit();
+            }
+            catch (...)
+            {
+                // Неудачная группа остаётся в буфере и повторяется
+                // через max_delay
+                _flushError = current_exception();
+            }
+        }
+    }
+};
+
+// Потокобезопасная база из shard_count независимых частей, запись попадает
+// в часть по хешу id. У каждой части свой shared_mutex, поэтому Put и Erase
+// блокируют только свою часть, а читатели всех индексов работают
+// параллельно. Упорядоченные запросы сливают курсоры частей: курсор под
+// блокировкой своей части запоминает ключи и номера следующих BATCH_SIZE
+// записей, строки копируются только перед выдачей записи, а callback
+// вызывается без блокировок. Поэтому медленный потребитель не задерживает
+// запись, но каждая выданная запись копируется: на быстрых callback одна
+// база под общим мьютексом обходит окна дешевле.
+// ForEach и агрегаты обходят части по одной. Все такие запросы не мешают
+// записи в остальные части, но видят части не в один момент времени:
+// записи, изменённые во время обхода, могут попасть или не попасть
+// в ответ, остальные попадают ровно один раз.
+// Record в callback действительна только во время вызова.
+class ConcurrentDatabase
+{
+public:
+    explicit ConcurrentDatabase(size_t shard_count = 16)
+        : _shards(shard_count)
+    {
+    }
+
+    bool Put(const Record &record)
+    {
+        Shard &shard = shardOf(record.id);
+        lock_guard<shared_mutex> guard(shard.locker);
+        return shard.db.Put(record);
+    }
+
+    bool Erase(string_view id)
+    {
+        Shard &shard = shardOf(id);
+        lock_guard<shared_mutex> guard(shard.locker);
+        return shard.db.Erase(id);
+    }
+
+    // Раскладывает записи по частям и загружает каждую часть одной BulkLoad
+    template <typename InputIt>
+    size_t BulkLoad(InputIt first, InputIt last)
+    {
+        vector<vector<Record>> parts(_shards.size());
+
+        for (; first != last; ++first)
+        {
+            const Record &record = *first;
+            parts[shardIndex(record.id)].push_back(record);
+        }
+
+        size_t added = 0;
+        for (size_t i = 0; i < parts.size(); ++i)
+        {
+            lock_guard<shared_mutex> guard(_shards[i].locker);
+            added += _shards[i].db.BulkLoad(parts[i].begin(), parts[i].end());
+        }
+
+        return added;
+    }
+
+    // Вызывает callback(const Record &) для найденной записи
+    template <typename Callback>
+    bool GetById(string_view id, Callback callback) const
+    {
+        const Shard &shard = shardOf(id);
+        shared_lock<shared_mutex> guard(shard.locker);
+        const auto record = shard.db.GetById(id);
+
+        if (record)
+        {
+            callback(*record);
+        }
+
+        return record != nullptr;
+    }
+
+    template <typename Callback>
+    void RangeByTimestamp(int low, int high, Callback callback) const
+    {
+        orderedRange([high](const Database &db, int from, auto collect)
+        {
+            db.RangeByTimestamp(from, high, collect);
+        }, low, &Record::timestamp, [](const Record &)
+        {
+            return true;
+        }, callback);
+    }
+
+    template <typename Callback>
+    void RangeByKarma(int low, int high, Callback callback) const
+    {
+        orderedRange([high](const Database &db, int from, auto collect)
+        {
+            db.RangeByKarma(from, high, collect);
+        }, low, &Record::karma, [](const Record &)
+        {
+            return true;
+        }, callback);
+    }
+
+    template <typename Callback>
+    void RangeByUserAndTimestamp(string_view user, int low, int high, Callback callback) const
+    {
+        orderedRange([user, high](const Database &db, int from, auto collect)
+        {
+            db.RangeByUserAndTimestamp(user, from, high, collect);
+        }, low, &Record::timestamp, [user](const Record &record)
+        {
+            return record.user == user;
+        }, callback);
+    }
+
+    template <typename Callback>
+    void RangeByUserAndKarma(string_view user, int low, int high, Callback callback) const
+    {
+        orderedRange([user, high](const Database &db, int from, auto collect)
+        {
+            db.RangeByUserAndKarma(user, from, high, collect);
+        }, low, &Record::karma, [user](const Record &record)
+        {
+            return record.user == user;
+        }, callback);
+    }
+
+    template <typename Callback>
+    void AllByUser(string_view user, Callback callback) const
+    {
+        RangeByUserAndTimestamp(user, numeric_limits<int>::min(), numeric_limits<int>::max(), callback);
+    }
+
+    // Обход окна времени без общего порядка, части блокируются по очереди
+    template <typename Callback>
+    void ForEachByTimestamp(int low, int high, Callback callback) const
+    {
+        for (const Shard &shard : _shards)
+        {
+            shared_lock<shared_mutex> guard(shard.locker);
+            shard.db.RangeByTimestamp(low, high, [&callback](const Record &record)
+            {
+                callback(record);
+                return true;
+            });
+        }
+    }
+
+    size_t CountByTimestamp(int low, int high) const
+    {
+        return sumShards([low, high](const Database &db)
+        {
+            return db.CountByTimestamp(low, high);
+        });
+    }
+
+    long long KarmaSumByTimestamp(int low, int high) const
+    {
+        return sumShards([low, high](const Database &db)
+        {
+            return db.KarmaSumByTimestamp(low, high);
+        });
+    }
+
+    size_t CountByUserAndTimestamp(string_view user, int low, int high) const
+    {
+        return sumShards([user, low, high](const Database &db)
+        {
+            return db.CountByUserAndTimestamp(user, low, high);
+        });
+    }
+
+    size_t Size() const
+    {
+        return sumShards([](const Database &db)
+        {
+            return db.Size();
+        });
+    }
+
+private:
+    struct alignas(64) Shard
+    {
+        mutable shared_mutex locker;
+        Database db;
+    };
+
+    vector<Shard> _shards;
+
+    size_t shardIndex(string_view id) const
+    {
+        return hash<string_view>{}(id) % _shards.size();
+    }
+
+    Shard &shardOf(string_view id)
+    {
+        return _shards[shardIndex(id)];
+    }
+
+    const Shard &shardOf(string_view id) const
+    {
+        return _shards[shardIndex(id)];
+    }
+
+    template <typename Query>
+    invoke_result_t<Query, const Database &> sumShards(Query query) const
+    {
+        invoke_result_t<Query, const Database &> result = 0;
+
+        for (const Shard &shard : _shards)
+        {
+            shared_lock<shared_mutex> guard(shard.locker);
+            result += query(shard.db);
+        }
+
+        return result;
+    }
+
+    // Обход одной части выборками по BATCH_SIZE записей. Выборка запоминает
+    // только ключи и номера записей. Индексы упорядочены по паре (ключ,
+    // номер), поэтому следующая выборка начинается с ключа последней записи
+    // и пропускает записи с этим ключом и номером не больше её номера.
+    struct Cursor
+    {
+        vector<pair<int, uint32_t>> entries;
+        size_t position = 0;
+        int from;
+        uint32_t lastHandle = 0;
+        bool resumed = false;
+        bool exhausted = false;
+
+        int Key() const
+        {
+            return entries[position].first;
+        }
+    };
+
+    // Запись, чья очередь выдачи уже определена слиянием, и копия её строк
+    struct Pending
+    {
+        size_t shard;
+        uint32_t handle;
+        int key;
+        bool found;
+        size_t offset;
+        uint32_t idSize;
+        uint32_t titleSize;
+        uint32_t userSize;
+        int timestamp;
+        int karma;
+    };
+
+    static constexpr size_t BATCH_SIZE = 256;
+    static constexpr size_t MIN_PENDING = 16;
+
+    // Сливает курсоры частей кучей по ключу текущих записей. Строки
+    // копируются только для записей, очередь которых уже подошла: порциями,
+    // растущими вдвое с MIN_PENDING до BATCH_SIZE, под одной блокировкой
+    // на часть. Так при раннем выходе из обхода лишних копий не больше,
+    // чем выданных записей, а callback вызывается без блокировок.
+    template <typename Query, typename Matches, typename Callback>
+    void orderedRange(Query query, int low, int Record::*key, Matches matches, Callback callback) const
+    {
+        vector<Cursor> cursors(_shards.size());
+        using Head = pair<int, size_t>;
+        priority_queue<Head, vector<Head>, greater<Head>> heads;
+
+        for (size_t i = 0; i < cursors.size(); ++i)
+        {
+            cursors[i].from = low;
+
+            if (fetch(_shards[i], cursors[i], query))
+            {
+                heads.push({cursors[i].Key(), i});
+            }
+        }
+
+        vector<Pending> pending;
+        string text;
+
+        for (size_t portion = MIN_PENDING; !heads.empty(); portion = min(2 * portion, BATCH_SIZE))
+        {
+            pending.clear();
+
+            while (!heads.empty() && pending.size() < portion)
+            {
+                const size_t i = heads.top().second;
+                heads.pop();
+                Cursor &cursor = cursors[i];
+                pending.push_back({i, cursor.entries[cursor.position].second, cursor.Key()});
+
+                if (++cursor.position < cursor.entries.size() || fetch(_shards[i], cursor, query))
+                {
+                    heads.push({cursor.Key(), i});
+                }
+            }
+
+            copyPending(pending, key, matches, text);
+
+            for (const Pending &p : pending)
+            {
+                const char *data = text.data() + p.offset;
+
+                if (p.found && !callback(Record{{data, p.idSize}, {data + p.idSize, p.titleSize},
+                                                {data + p.idSize + p.titleSize, p.userSize},
+                                                p.timestamp, p.karma}))
+                {
+                    return;
+                }
+            }
+        }
+    }
+
+    // Копирует строки записей порции в text, блокируя каждую часть один раз.
+    // Запись, удалённая после выборки или чей номер достался другой записи,
+    // помечается как не найденная.
+    template <typename Matches>
+    void copyPending(vector<Pending> &pending, int Record::*key, Matches matches, string &text) const
+    {
+        // Раскладываем порцию по частям сортировкой подсчётом
+        vector<size_t> offsets(_shards.size() + 1);
+        for (const Pending &p : pending)
+        {
+            ++offsets[p.shard + 1];
+        }
+
+        partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+        vector<Pending *> grouped(pending.size());
+        auto positions = offsets;
+        for (Pending &p : pending)
+        {
+            grouped[positions[p.shard]++] = &p;
+        }
+
+        text.clear();
+
+        for (size_t i = 0; i < _shards.size(); ++i)
+        {
+            if (offsets[i] == offsets[i + 1])
+            {
+                continue;
+            }
+
+            shared_lock<shared_mutex> guard(_shards[i].locker);
+
+            for (size_t j = offsets[i]; j < offsets[i + 1]; ++j)
+            {
+                Pending &p = *grouped[j];
+                const Record *stored = _shards[i].db.GetByHandle(p.handle);
+                p.found = stored && stored->*key == p.key && matches(*stored);
+
+                if (p.found)
+                {
+                    p.offset = text.size();
+                    p.idSize = stored->id.size();
+                    p.titleSize = stored->title.size();
+                    p.userSize = stored->user.size();
+                    p.timestamp = stored->timestamp;
+                    p.karma = stored->karma;
+                    text.append(stored->id);
+                    text.append(stored->title);
+                    text.append(stored->user);
+                }
+            }
+        }
+    }
+
+    // Заполняет курсор следующей выборкой части. Возвращает false,
+    // если записей в части больше нет.
+    template <typename Query>
+    static bool fetch(const Shard &shard, Cursor &cursor, Query query)
+    {
+        if (cursor.exhausted)
+        {
+            return false;
+        }
+
+        // Выборка кладёт восемь байт на запись, так что место под целую
+        // выборку дешевле, чем рост вектора по ходу
+        cursor.entries.clear();
+        cursor.entries.reserve(BATCH_SIZE);
+        cursor.position = 0;
+        {
+            shared_lock<shared_mutex> guard(shard.locker);
+            query(shard.db, cursor.from, [&cursor](uint32_t handle, int key)
+            {
+                if (cursor.resumed && key == cursor.from && handle <= cursor.lastHandle)
+                {
+                    return true;
+                }
+
+                cursor.entries.emplace_back(key, handle);
+                return cursor.entries.size() < BATCH_SIZE;
+            });
+        }
+
+        cursor.exhausted = cursor.entries.size() < BATCH_SIZE;
+
+        if (cursor.entries.empty())
+        {
+            return false;
+        }
+
+        tie(cursor.from, cursor.lastHandle) = cursor.entries.back();
+        cursor.resumed = true;
+        return true;
+    }
+};
+
+void TestRangeBoundaries()
+{
+    const int good_karma = 1000;
+    const int bad_karma = -10;
+
+    Database db;
+    db.Put({"id1", "Hello there", "master", 1536107260, good_karma});
+    db.Put({"id2", "O>>-<", "general2", 1536107260, bad_karma});
+
+    int count = 0;
+    db.RangeByKarma(bad_karma, good_karma, [&count](const Record &)
+    {
+        ++count;
+        return true;
+    });
+
+    ASSERT_EQUAL(2, count);
+}
+
+void TestSameUser()
+{
+    Database db;
+    db.Put({"id1", "Don't sell", "master", 1536107260, 1000});
+    db.Put({"id2", "Rethink life", "master", 1536107260, 2000});
+
+    int count = 0;
+    db.AllByUser("master", [&count](const Record &)
+    {
+        ++count;
+        return true;
+    });
+
+    ASSERT_EQUAL(2, count);
+}
+
+void TestReplacement()
+{
+    const string final_body = "Feeling sad";
+
+    Database db;
+    db.Put({"id", "Have a hand", "not-master", 1536107260, 10});
+    db.Erase("id");
+    db.Put({"id", final_body, "not-master", 1536107260, -10});
+
+    auto record = db.GetById("id");
+    ASSERT(record != nullptr);
+    ASSERT_EQUAL(final_body, record->title);
+}
+
+void TestStableText()
+{
+    Database db;
+    db.Put({"last", "title", "user1", 5, 5});
+    const Record *last = db.GetById("last");
+    const size_t empty_usage = db.MemoryUsage();
+
+    for (int round = 0; round < 3; ++round)
+    {
+        for (int i = 0; i < 10000; ++i)
+        {
+            const string id = "id" + to_string(i);
+            db.Put({id, string(1000, 'a' + round), "user" + to_string(i % 3), i, round});
+        }
+        for (int i = 0; i < 10000; i += 2)
+        {
+            db.Erase("id" + to_string(i));
+            db.Erase("id" + to_string(i + 1));
+        }
+    }
+    db.Compact();
+
+    // Указатель и строки записи пережили слияния, а блоки арены
+    // с удалёнными строками возвращены
+    ASSERT_EQUAL(db.GetById("last"), last);
+    ASSERT_EQUAL(last->id, "last");
+    ASSERT_EQUAL(last->title, "title");
+    ASSERT(db.MemoryUsage() < empty_usage + 4 * 1024 * 1024);
+
+    for (int i = 0; i < 10000; ++i)
+    {
+        db.Put({"id" + to_string(i), "fresh", "user2", i, i});
+    }
+    db.Compact();
+
+    ASSERT_EQUAL(last->title, "title");
+    ASSERT_EQUAL(db.GetById("id42")->title, "fresh");
+    ASSERT_EQUAL(db.GetById("id42")->user, "user2");
+    ASSERT_EQUAL(db.CountByUserAndTimestamp("user2", 0, 10000), 10000u);
+    ASSERT(db.GetById("id10000") == nullptr);
+}
+
+// Запись, владеющая своими строками
+struct OwnedRecord
+{
+    string id;
+    string title;
+    string user;
+    int timestamp;
+    int karma;
+
+    operator Record() const
+    {
+        return {id, title, user, timestamp, karma};
+    }
+};
+
+vector<OwnedRecord> RandomRecords(size_t count, int seed = 42)
+{
+    mt19937 gen(seed);
+    uniform_int_distribution<int> user_dist(0, 99);
+    uniform_int_distribution<int> ts_dist(0, 100000);
+    uniform_int_distribution<int> karma_dist(-1000, 1000);
+
+    vector<OwnedRecord> records;
+    records.reserve(count);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        records.push_back({
+            "id" + to_string(i),
+            "title",
+            "user" + to_string(user_dist(gen)),
+            ts_dist(gen),
+            karma_dist(gen)
+        });
+    }
+
+    return records;
+}
+
+// Сверяет ответы базы с полным перебором оставшихся записей
+void CheckAgainstBruteForce(const Database &db, const vector<OwnedRecord> &records, const vector<bool> &present)
+{
+    for (auto [low, high] : {pair{0, 100000}, pair{500, 700}, pair{99990, 100000}, pair{-5, -1}})
+    {
+        int expected = 0;
+        long long expected_sum = 0;
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            if (present[i] && records[i].timestamp >= low && records[i].timestamp <= high)
+            {
+                ++expected;
+                expected_sum += records[i].karma;
+            }
+        }
+
+        int count = 0;
+        long long sum = 0;
+        int last_ts = numeric_limits<int>::min();
+        bool sorted = true;
+        db.RangeByTimestamp(low, high, [&](const Record &record)
+        {
+            ++count;
+            sum += record.karma;
+            sorted = sorted && last_ts <= record.timestamp;
+            last_ts = record.timestamp;
+            return true;
+        });
+
+        ASSERT_EQUAL(count, expected);
+        ASSERT_EQUAL(sum, expected_sum);
+        ASSERT(sorted);
+
+        ASSERT_EQUAL(db.CountByTimestamp(low, high), static_cast<size_t>(expected));
+        ASSERT_EQUAL(db.KarmaSumByTimestamp(low, high), expected_sum);
+
+        vector<int> karmas;
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            if (present[i] && records[i].timestamp >= low && records[i].timestamp <= high)
+            {
+                karmas.push_back(records[i].karma);
+            }
+        }
+        sort(karmas.rbegin(), karmas.rend());
+        karmas.resize(min<size_t>(karmas.size(), 10));
+
+        vector<int> top;
+        for (const Record &record : db.TopByKarma(low, high, 10))
+        {
+            top.push_back(record.karma);
+        }
+        ASSERT_EQUAL(top, karmas);
+
+        mutex locker;
+        long long parallel_sum = 0;
+        db.ParallelRangeByTimestamp(low, high, [&](const Record &record)
+        {
+            lock_guard<mutex> guard(locker);
+            parallel_sum += record.karma;
+        }, 3);
+        ASSERT_EQUAL(parallel_sum, expected_sum);
+    }
+
+    int expected = 0;
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        expected += present[i] && records[i].user == "user7";
+    }
+
+    int count = 0;
+    db.AllByUser("user7", [&count](const Record &record)
+    {
+        count += record.user == "user7";
+        return true;
+    });
+    ASSERT_EQUAL(count, expected);
+
+    for (auto [low, high] : {pair{0, 100000}, pair{30000, 33600}, pair{-1000, 1000}})
+    {
+        vector<int> expected_ts;
+        vector<int> expected_karma;
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            if (present[i] && records[i].user == "user7")
+            {
+                if (records[i].timestamp >= low && records[i].timestamp <= high)
+                {
+                    expected_ts.push_back(records[i].timestamp);
+                }
+                if (records[i].karma >= low && records[i].karma <= high)
+                {
+                    expected_karma.push_back(records[i].karma);
+                }
+            }
+        }
+        sort(expected_ts.begin(), expected_ts.end());
+        sort(expected_karma.begin(), expected_karma.end());
+
+        vector<int> ts;
+        db.RangeByUserAndTimestamp("user7", low, high, [&ts](const Record &record)
+        {
+            ASSERT_EQUAL(record.user, "user7");
+            ts.push_back(record.timestamp);
+            return true;
+        });
+        ASSERT_EQUAL(ts, expected_ts);
+        ASSERT_EQUAL(db.CountByUserAndTimestamp("user7", low, high), expected_ts.size());
+
+        vector<int> karma;
+        db.RangeByUserAndKarma("user7", low, high, [&karma](const Record &record)
+        {
+            ASSERT_EQUAL(record.user, "user7");
+            karma.push_back(record.karma);
+            return true;
+        });
+        ASSERT_EQUAL(karma, expected_karma);
+    }
+}
+
+void TestUserRanges()
+{
+    Database db;
+    db.Put({"id1", "a", "master", 100, 5});
+    db.Put({"id2", "b", "master", 50, -5});
+    db.Put({"id3", "c", "mastery", 70, 10});
+    db.Put({"id4", "d", "maste", 70, 10});
+    db.Put({"id5", "e", "master", 200, 0});
+
+    vector<string> ids;
+    db.RangeByUserAndTimestamp("master", 50, 150, [&ids](const Record &record)
+    {
+        ids.emplace_back(record.id);
+        return true;
+    });
+    ASSERT_EQUAL(ids, (vector<string>{"id2", "id1"}));
+
+    ids.clear();
+    db.RangeByUserAndKarma("master", -10, 10, [&ids](const Record &record)
+    {
+        ids.emplace_back(record.id);
+        return true;
+    });
+    ASSERT_EQUAL(ids, (vector<string>{"id2", "id5", "id1"}));
+
+    db.Erase("id2");
+    db.Compact();
+    ASSERT_EQUAL(db.CountByUserAndTimestamp("master", 0, 1000), 2u);
+    ASSERT_EQUAL(db.CountByUserAndTimestamp("nobody", 0, 1000), 0u);
+}
+
+void TestBulkLoad()
+{
+    const auto records = RandomRecords(20000);
+
+    Database db;
+    ASSERT_EQUAL(db.BulkLoad(records.begin(), records.begin() + 15000), 15000u);
+    ASSERT_EQUAL(db.BulkLoad(records.begin() + 10000, records.end()), 5000u);
+
+    CheckAgainstBruteForce(db, records, vector<bool>(records.size(), true));
+    ASSERT_EQUAL(db.GetById("id123")->karma, records[123].karma);
+}
+
+void TestDeltaMerge()
+{
+    const auto records = RandomRecords(20000);
+    vector<bool> present(records.size());
+
+    Database db;
+    db.BulkLoad(records.begin(), records.begin() + 5000);
+    fill(present.begin(), present.begin() + 5000, true);
+
+    mt19937 gen(7);
+    for (int step = 0; step < 30000; ++step)
+    {
+        const size_t i = gen() % records.size();
+
+        if (gen() % 2)
+        {
+            ASSERT_EQUAL(db.Put(records[i]), !present[i]);
+            present[i] = true;
+        }
+        else
+        {
+            ASSERT_EQUAL(db.Erase(records[i].id), present[i]);
+            present[i] = false;
+        }
+
+        if (step % 7000 == 0)
+        {
+            CheckAgainstBruteForce(db, records, present);
+        }
+    }
+
+    CheckAgainstBruteForce(db, records, present);
+    db.Compact();
+    CheckAgainstBruteForce(db, records, present);
+}
+
+void TestEqualTimestamps()
+{
+    vector<OwnedRecord> records;
+    for (int i = 0; i < 5000; ++i)
+    {
+        records.push_back({"id" + to_string(i), "title", "user", 42, i});
+    }
+
+    Database db;
+    db.BulkLoad(records.begin(), records.end());
+    db.Put({"single", "title", "user", 7, 1000});
+
+    long long expected_sum = 0;
+    for (int i = 0; i < 5000; ++i)
+    {
+        if (i % 3 == 0)
+        {
+            db.Erase(records[i].id);
+        }
+        else
+        {
+            expected_sum += i;
+        }
+    }
+
+    ASSERT_EQUAL(db.CountByTimestamp(42, 42), 5000u - 1667u);
+    ASSERT_EQUAL(db.KarmaSumByTimestamp(42, 42), expected_sum);
+
+    db.Compact();
+    int count = 0;
+    db.ParallelRangeByTimestamp(7, 7, [&count](const Record &)
+    {
+        ++count;
+    }, 0);
+    ASSERT_EQUAL(count, 1);
+}
+
+string TestDirectory()
+{
+    const auto path = filesystem::temp_directory_path() / "secondary_index_test";
+    filesystem::remove_all(path);
+    return path.string();
+}
+
+void TestSnapshot()
+{
+    const auto records = RandomRecords(20000);
+    vector<bool> present(records.size());
+    const string path = TestDirectory() + ".snapshot";
+
+    Database db;
+    db.BulkLoad(records.begin(), records.begin() + 10000);
+    fill(present.begin(), present.begin() + 10000, true);
+
+    mt19937 gen(11);
+    for (int step = 0; step < 10000; ++step)
+    {
+        const size_t i = gen() % records.size();
+
+        if (gen() % 2)
+        {
+            db.Put(records[i]);
+            present[i] = true;
+        }
+        else
+        {
+            db.Erase(records[i].id);
+            present[i] = false;
+        }
+    }
+    db.SaveSnapshot(path);
+
+    Database loaded;
+    loaded.LoadSnapshot(path);
+    ASSERT_EQUAL(loaded.Size(), db.Size());
+    CheckAgainstBruteForce(loaded, records, present);
+
+    // Строки загруженных записей живут в отображении файла, в том числе
+    // после переноса живых строк в арену
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        if (present[i] && loaded.Erase(records[i].id))
+        {
+            present[i] = false;
+        }
+        if (i % 3 == 0)
+        {
+            loaded.Put(records[i]);
+            present[i] = true;
+        }
+    }
+    loaded.Compact();
+    CheckAgainstBruteForce(loaded, records, present);
+    ASSERT_EQUAL(loaded.GetById("id3")->user, records[3].user);
+
+    // Новый снимок поверх отображённого не портит строки загруженной базы
+    loaded.SaveSnapshot(path);
+    CheckAgainstBruteForce(loaded, records, present);
+    ASSERT(!filesystem::exists(path + ".tmp"));
+
+    Database reloaded;
+    reloaded.LoadSnapshot(path);
+    CheckAgainstBruteForce(reloaded, records, present);
+
+    try
+    {
+        loaded.LoadSnapshot(path);
+        ASSERT(false);
+    }
+    catch (logic_error &)
+    {
+    }
+
+    // Испорченный снимок не оставляет полузагруженной базы: после ошибки
+    // база пуста и в неё загружается исправный снимок
+    const string good = path + ".good";
+    filesystem::copy_file(path, good);
+
+    auto patch = [&path](uint64_t offset, auto value)
+    {
+        fstream file(path, ios::in | ios::out | ios::binary);
+        file.seekp(offset);
+        file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    };
+    auto headerField = [&path](uint64_t offset)
+    {
+        ifstream file(path, ios::binary);
+        uint64_t value = 0;
+        file.seekg(offset);
+        file.read(reinterpret_cast<char *>(&value), sizeof(value));
+        return value;
+    };
+    auto expectCorrupted = [&path, &good](Database &db)
+    {
+        try
+        {
+            db.LoadSnapshot(path);
+            ASSERT(false);
+        }
+        catch (runtime_error &)
+        {
+        }
+        ASSERT_EQUAL(db.Size(), 0u);
+        ASSERT(db.GetById("id3") == nullptr);
+        filesystem::copy_file(good, path, filesystem::copy_options::overwrite_existing);
+    };
+
+    // Заголовок: магия, затем число записей, пользователей, байт имён и текста
+    const uint64_t tail = headerField(16) * sizeof(uint32_t) + headerField(24) + headerField(32);
+    patch(filesystem::file_size(path) - tail - sizeof(uint32_t), numeric_limits<uint32_t>::max());
+    Database broken;
+    expectCorrupted(broken);
+
+    // Число записей, при котором размер файла переполняется
+    patch(8, uint64_t(1) << 60);
+    expectCorrupted(broken);
+
+    filesystem::resize_file(path, filesystem::file_size(path) - 1);
+    expectCorrupted(broken);
+
+    broken.LoadSnapshot(path);
+    CheckAgainstBruteForce(broken, records, present);
+    filesystem::remove(good);
+    filesystem::remove(path);
+}
+
+void TestWriteAheadLog()
+{
+    const string directory = TestDirectory();
+    const auto records = RandomRecords(3000);
+
+    {
+        PersistentDatabase db(directory, 100);
+        for (size_t i = 0; i < 1000; ++i)
+        {
+            db.Put(records[i]);
+        }
+        db.Erase("id5");
+        ASSERT(!db.Put(records[7]));
+    }
+    {
+        PersistentDatabase db(directory, 100);
+        ASSERT_EQUAL(db.Get().Size(), 999u);
+        ASSERT(db.Get().GetById("id5") == nullptr);
+        ASSERT_EQUAL(db.Get().GetById("id7")->karma, records[7].karma);
+
+        db.Checkpoint();
+        ASSERT_EQUAL(filesystem::file_size(directory + "/log"), 0u);
+        for (size_t i = 1000; i < 2000; ++i)
+        {
+            db.Put(records[i]);
+        }
+        db.Erase("id1500");
+        db.Erase("id10");
+    }
+
+    // Оборванная запись в хвосте журнала отбрасывается
+    {
+        OutputFile log(directory + "/log", O_WRONLY | O_APPEND);
+        log.Write("\x10\0\0\0garbage");
+    }
+    {
+        PersistentDatabase db(directory, 100);
+        ASSERT_EQUAL(db.Get().Size(), 1997u);
+        ASSERT(db.Get().GetById("id1500") == nullptr);
+        ASSERT(db.Get().GetById("id10") == nullptr);
+        ASSERT_EQUAL(db.Get().GetById("id1999")->title, records[1999].title);
+        db.Put(records[2000]);
+    }
+    {
+        PersistentDatabase db(directory, 100);
+        ASSERT_EQUAL(db.Get().Size(), 1998u);
+        ASSERT(db.Get().GetById("id2000") != nullptr);
+    }
+
+    // Неполная группа сбрасывается на диск по времени
+    {
+        PersistentDatabase db(directory, 1000000, chrono::milliseconds(10));
+        db.Checkpoint();
+        db.Put(records[2001]);
+        this_thread::sleep_for(chrono::milliseconds(200));
+        ASSERT(filesystem::file_size(directory + "/log") > 0u);
+    }
+
+    filesystem::remove_all(directory);
+}
+
+void TestRestartSpeed()
+{
+    const string directory = TestDirectory();
+    const auto records = RandomRecords(1000000);
+
+    {
+        LOG_DURATION("Log 200000 puts");
+        PersistentDatabase db(directory, 1024);
+        for (size_t i = 0; i < 200000; ++i)
+        {
+            db.Put(records[i]);
+        }
+    }
+    {
+        optional<PersistentDatabase> db;
+        {
+            LOG_DURATION("Replay 200000 puts from log");
+            db.emplace(directory);
+        }
+        {
+            LOG_DURATION("Checkpoint 200000 records");
+            db->Checkpoint();
+        }
+    }
+
+    Database db;
+    {
+        LOG_DURATION("BulkLoad 1000000 records");
+        db.BulkLoad(records.begin(), records.end());
+    }
+    const string path = directory + "/snapshot";
+    {
+        LOG_DURATION("SaveSnapshot 1000000 records");
+        db.SaveSnapshot(path);
+    }
+    {
+        LOG_DURATION("LoadSnapshot 1000000 records");
+        Database loaded;
+        loaded.LoadSnapshot(path);
+        ASSERT_EQUAL(loaded.Size(), records.size());
+    }
+
+    filesystem::remove_all(directory);
+}
+
+void TestConcurrentDatabase()
+{
+    const auto records = RandomRecords(20000);
+    const size_t writers = 4;
+
+    ConcurrentDatabase db(8);
+    atomic<bool> done{false};
+
+    vector<future<void>> futures;
+    for (size_t w = 0; w < writers; ++w)
+    {
+        futures.push_back(async(launch::async, [&records, &db, w]
+        {
+            for (size_t i = w; i < records.size(); i += writers)
+            {
+                ASSERT(db.Put(records[i]));
+            }
+            for (size_t i = w; i < records.size(); i += writers)
+            {
+                if (i % 3 == 0)
+                {
+                    ASSERT(db.Erase(records[i].id));
+                }
+            }
+        }));
+    }
+
+    auto reader = [&db, &done]
+    {
+        size_t rounds = 0;
+        while (!done || rounds == 0)
+        {
+            int last = numeric_limits<int>::min();
+            db.RangeByTimestamp(40000, 45000, [&last](const Record &record)
+            {
+                ASSERT(last <= record.timestamp);
+                last = record.timestamp;
+                return true;
+            });
+            db.RangeByUserAndKarma("user3", -100, 100, [](const Record &record)
+            {
+                ASSERT_EQUAL(record.user, "user3");
+                return true;
+            });
+            db.GetById("id77", [](const Record &record)
+            {
+                ASSERT_EQUAL(record.id, "id77");
+            });
+            db.CountByUserAndTimestamp("user5", 0, 50000);
+            ++rounds;
+        }
+    };
+    auto first_reader = async(launch::async, reader);
+    auto second_reader = async(launch::async, reader);
+
+    for (auto &f : futures)
+    {
+        f.get();
+    }
+    done = true;
+    first_reader.get();
+    second_reader.get();
+
+    ASSERT_EQUAL(db.Size(), records.size() - (records.size() + 2) / 3);
+    for (auto [low, high] : {pair{0, 100000}, pair{500, 2000}})
+    {
+        size_t expected = 0;
+        long long expected_sum = 0;
+        size_t expected_user = 0;
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            if (i % 3 != 0 && records[i].timestamp >= low && records[i].timestamp <= high)
+            {
+                ++expected;
+                expected_sum += records[i].karma;
+                expected_user += records[i].user == "user9";
+            }
+        }
+
+        size_t count = 0;
+        db.RangeByTimestamp(low, high, [&count](const Record &)
+        {
+            ++count;
+            return true;
+        });
+        ASSERT_EQUAL(count, expected);
+        ASSERT_EQUAL(db.CountByTimestamp(low, high), expected);
+        ASSERT_EQUAL(db.KarmaSumByTimestamp(low, high), expected_sum);
+        ASSERT_EQUAL(db.CountByUserAndTimestamp("user9", low, high), expected_user);
+
+        count = 0;
+        db.ForEachByTimestamp(low, high, [&count](const Record &)
+        {
+            ++count;
+        });
+        ASSERT_EQUAL(count, expected);
+    }
+}
+
+void TestConcurrentDatabaseCursors()
+{
+    vector<OwnedRecord> records;
+    for (int i = 0; i < 3000; ++i)
+    {
+        records.push_back({"id" + to_string(i), "title", "user" + to_string(i % 2), i % 5, i});
+    }
+
+    ConcurrentDatabase db(4);
+    db.BulkLoad(records.begin(), records.end());
+
+    // Выборки кончаются посреди записей с равным ключом
+    set<string> ids;
+    int last = numeric_limits<int>::min();
+    db.RangeByTimestamp(0, 4, [&](const Record &record)
+    {
+        ASSERT(last <= record.timestamp);
+        last = record.timestamp;
+        ids.insert(string(record.id));
+        return true;
+    });
+    ASSERT_EQUAL(ids.size(), records.size());
+
+    size_t count = 0;
+    db.RangeByUserAndTimestamp("user1", 2, 3, [&count](const Record &record)
+    {
+        ASSERT_EQUAL(record.user, "user1");
+        ASSERT(record.timestamp == 2 || record.timestamp == 3);
+        ++count;
+        return true;
+    });
+    ASSERT_EQUAL(count, 600u);
+
+    // Запись, удалённая после выборки, но до выдачи, не выдаётся
+    bool erased = false;
+    db.RangeByKarma(0, 3000, [&db, &erased](const Record &record)
+    {
+        ASSERT(record.id != "id2999");
+        erased = erased || db.Erase("id2999");
+        return true;
+    });
+    ASSERT(erased);
+    db.Put(records.back());
+
+    // callback вызывается без блокировок: можно менять базу и прервать обход
+    count = 0;
+    db.RangeByKarma(0, 3000, [&db, &count](const Record &record)
+    {
+        db.Erase(record.id);
+        return ++count < 10;
+    });
+    ASSERT_EQUAL(count, 10u);
+    ASSERT_EQUAL(db.Size(), records.size() - 10);
+}
+
+// Смешанная нагрузка: писатели добавляют и удаляют записи, читатели
+// проверяют окна пользователей и сканируют окна времени
+template <typename Put, typename Erase, typename Read>
+void RunMixedLoad(const vector<OwnedRecord> &records, size_t base, Put put, Erase erase, Read read,
+                  int reads = 2000)
+{
+    const size_t writers = 2;
+    const size_t readers = 4;
+    vector<future<void>> futures;
+
+    for (size_t w = 0; w < writers; ++w)
+    {
+        futures.push_back(async(launch::async, [&, w]
+        {
+            for (size_t i = base + w; i < records.size(); i += writers)
+            {
+                put(records[i]);
+                erase(records[i - base].id);
+            }
+        }));
+    }
+    for (size_t r = 0; r < readers; ++r)
+    {
+        futures.push_back(async(launch::async, [&, r]
+        {
+            for (int i = 0; i < reads; ++i)
+            {
+                read(static_cast<int>((i * 97 + r * 13) % 96400), "user" + to_string((i + r) % 100));
+            }
+        }));
+    }
+
+    for (auto &f : futures)
+    {
+        f.get();
+    }
+}
+
+void TestConcurrentDatabaseSpeed()
+{
+    const size_t base = 200000;
+    const auto records = RandomRecords(base + 100000);
+
+    {
+        mutex locker;
+        Database db;
+        db.BulkLoad(records.begin(), records.begin() + base);
+
+        LOG_DURATION("Mixed load, Database under one mutex");
+        RunMixedLoad(records, base, [&](const Record &record)
+        {
+            lock_guard<mutex> guard(locker);
+            db.Put(record);
+        }, [&](string_view id)
+        {
+            lock_guard<mutex> guard(locker);
+            db.Erase(id);
+        }, [&](int low, const string &user)
+        {
+            lock_guard<mutex> guard(locker);
+            db.CountByUserAndTimestamp(user, low, low + 3600);
+            db.RangeByTimestamp(low, low + 100, [](const Record &)
+            {
+                return true;
+            });
+        });
+    }
+    {
+        ConcurrentDatabase db;
+        db.BulkLoad(records.begin(), records.begin() + base);
+
+        LOG_DURATION("Mixed load, ConcurrentDatabase");
+        RunMixedLoad(records, base, [&](const Record &record)
+        {
+            db.Put(record);
+        }, [&](string_view id)
+        {
+            db.Erase(id);
+        }, [&](int low, const string &user)
+        {
+            db.CountByUserAndTimestamp(user, low, low + 3600);
+            db.RangeByTimestamp(low, low + 100, [](const Record &)
+            {
+                return true;
+            });
+        });
+    }
+
+    // Читатели отдают записи медленному потребителю, например пишут их
+    // в сеть. Под одним мьютексом все ждут, пока читатель не отдаст окно,
+    // а ConcurrentDatabase вызывает callback без блокировок, поэтому
+    // ожидания читателей перекрываются друг с другом и с записью.
+    const vector<OwnedRecord> fewer(records.begin(), records.begin() + base + 20000);
+    auto slowReader = []
+    {
+        return [count = 0](const Record &) mutable
+        {
+            if (++count % 64 == 0)
+            {
+                this_thread::sleep_for(chrono::microseconds(200));
+            }
+            return true;
+        };
+    };
+    {
+        mutex locker;
+        Database db;
+        db.BulkLoad(fewer.begin(), fewer.begin() + base);
+
+        LOG_DURATION("Mixed load with slow readers, Database under one mutex");
+        RunMixedLoad(fewer, base, [&](const Record &record)
+        {
+            lock_guard<mutex> guard(locker);
+            db.Put(record);
+        }, [&](string_view id)
+        {
+            lock_guard<mutex> guard(locker);
+            db.Erase(id);
+        }, [&](int low, const string &)
+        {
+            lock_guard<mutex> guard(locker);
+            db.RangeByTimestamp(low, low + 100, slowReader());
+        }, 200);
+    }
+    {
+        ConcurrentDatabase db;
+        db.BulkLoad(fewer.begin(), fewer.begin() + base);
+
+        LOG_DURATION("Mixed load with slow readers, ConcurrentDatabase");
+        RunMixedLoad(fewer, base, [&](const Record &record)
+        {
+            db.Put(record);
+        }, [&](string_view id)
+        {
+            db.Erase(id);
+        }, [&](int low, const string &)
+        {
+            db.RangeByTimestamp(low, low + 100, slowReader());
+        }, 200);
+    }
+}
+
+// Оценка памяти прежней раскладки: записи из трёх std::string, копии id
+// в хеш-таблице и пользователя в каждом из двух составных индексов
+size_t LegacyMemoryUsage(const vector<OwnedRecord> &records)
+{
+    auto heap = [](const string &text)
+    {
+        return text.size() < sizeof(string) / 2 ? 0 : text.size() + 1;
+    };
+
+    size_t result = 0;
+    for (const auto &record : records)
+    {
+        result += sizeof(OwnedRecord) + heap(record.id) + heap(record.title) + heap(record.user);
+        result += sizeof(pair<string, uint32_t>) + 3 * sizeof(void *) + heap(record.id);
+        result += 2 * (sizeof(pair<pair<string, int>, uint32_t>) + heap(record.user));
+        result += 2 * sizeof(pair<int, uint32_t>) + 2 * sizeof(int) + sizeof(long long) + 2 * sizeof(size_t);
+    }
+
+    return result;
+}
+
+void TestLoadSpeed()
+{
+    const auto records = RandomRecords(1000000);
+
+    {
+        LOG_DURATION("Put one by one");
+        Database db;
+        for (const auto &record : records)
+        {
+            db.Put(record);
+        }
+    }
+
+    Database db;
+    {
+        LOG_DURATION("BulkLoad");
+        db.BulkLoad(records.begin(), records.end());
+    }
+    cerr << "Bytes per record: " << db.MemoryUsage() / records.size()
+         << ", with std::string records: " << LegacyMemoryUsage(records) / records.size() << endl;
+    long long sum = 0;
+    {
+        LOG_DURATION("RangeByTimestamp over everything");
+        db.RangeByTimestamp(0, 100000, [&sum](const Record &record)
+        {
+            sum += record.karma;
+            return true;
+        });
+    }
+    {
+        LOG_DURATION("ParallelRangeByTimestamp, 4 threads");
+        atomic<long long> parallel_sum{0};
+        db.ParallelRangeByTimestamp(0, 100000, [&parallel_sum](const Record &record)
+        {
+            parallel_sum += record.karma;
+        }, 4);
+        ASSERT_EQUAL(parallel_sum.load(), sum);
+    }
+    {
+        LOG_DURATION("KarmaSumByTimestamp over everything");
+        ASSERT_EQUAL(db.KarmaSumByTimestamp(0, 100000), sum);
+    }
+
+    // Типичная проверка «постов пользователя за последний час»
+    size_t scanned = 0;
+    size_t seeked = 0;
+    {
+        LOG_DURATION("10000 user windows via AllByUser");
+        for (int i = 0; i < 10000; ++i)
+        {
+            const int low = i * 7 % 96400;
+            db.AllByUser("user" + to_string(i % 100), [&](const Record &record)
+            {
+                scanned += record.timestamp >= low && record.timestamp <= low + 3600;
+                return true;
+            });
+        }
+    }
+    {
+        LOG_DURATION("10000 user windows via RangeByUserAndTimestamp");
+        for (int i = 0; i < 10000; ++i)
+        {
+            const int low = i * 7 % 96400;
+            seeked += db.CountByUserAndTimestamp("user" + to_string(i % 100), low, low + 3600);
+        }
+    }
+    ASSERT_EQUAL(seeked, scanned);
 }
 
 int main()
@@ -187,5 +3128,17 @@ int main()
     RUN_TEST(tr, TestRangeBoundaries);
     RUN_TEST(tr, TestSameUser);
     RUN_TEST(tr, TestReplacement);
+    RUN_TEST(tr, TestStableText);
+    RUN_TEST(tr, TestUserRanges);
+    RUN_TEST(tr, TestBulkLoad);
+    RUN_TEST(tr, TestDeltaMerge);
+    RUN_TEST(tr, TestEqualTimestamps);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestWriteAheadLog);
+    RUN_TEST(tr, TestConcurrentDatabase);
+    RUN_TEST(tr, TestConcurrentDatabaseCursors);
+    RUN_TEST(tr, TestLoadSpeed);
+    RUN_TEST(tr, TestRestartSpeed);
+    RUN_TEST(tr, TestConcurrentDatabaseSpeed);
     return 0;
 }
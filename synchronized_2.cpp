@@ -1,27 +1,94 @@
 #include "test_runner.h"
+#include "profile.h"
+#include "combinable.h"
 
 #include <numeric>
 #include <vector>
 #include <string>
 #include <future>
 #include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include <utility>
 #include <queue>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <iterator>
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
-template <typename T>
+template <typename Mutex, typename = void>
+struct IsSharedMutex : false_type
+{
+};
+
+template <typename Mutex>
+struct IsSharedMutex<Mutex, void_t<decltype(declval<Mutex &>().lock_shared())>> : true_type
+{
+};
+
+// Mutex задаёт тип блокировки. Для shared_mutex и shared_timed_mutex
+// константный доступ берёт разделяемую блокировку, так что читатели
+// не блокируют друг друга, и становится доступен GetUpgradableAccess.
+template <typename T, typename Mutex = mutex>
 class Synchronized
 {
 public:
+    static constexpr bool IS_SHARED = IsSharedMutex<Mutex>::value;
+
+    using ReadLock = conditional_t<IS_SHARED, shared_lock<Mutex>, lock_guard<Mutex>>;
+
     struct SyncAccess
     {
-        lock_guard<mutex> guard;
+        lock_guard<Mutex> guard;
         T &ref_to_value;
     };
 
     struct SyncAccessConst
     {
-        lock_guard<mutex> guard;
+        ReadLock guard;
+        const T &ref_to_value;
+    };
+
+    // Читает под разделяемой блокировкой и по требованию атомарно
+    // переходит к записи: одновременно такой доступ может держать только
+    // один поток, а писатели не могут вклиниться между чтением и Upgrade
+    class UpgradableAccess
+    {
+    private:
+        unique_lock<mutex> _upgradeGuard;
+        shared_lock<Mutex> _readGuard;
+        unique_lock<Mutex> _writeGuard;
+        T &_value;
+
+    public:
         const T &ref_to_value;
+
+        explicit UpgradableAccess(Synchronized &owner)
+            : _upgradeGuard(owner.upgradeLocker)
+            , _readGuard(owner.locker)
+            , _value(owner.value)
+            , ref_to_value(owner.value)
+        {
+        }
+
+        T &Upgrade()
+        {
+            if (!_writeGuard.owns_lock())
+            {
+                _readGuard.unlock();
+                _writeGuard = unique_lock<Mutex>(*_readGuard.mutex());
+            }
+
+            return _value;
+        }
     };
 
     explicit Synchronized(T initial = T()) : value(initial)
@@ -30,17 +97,320 @@ public:
 
     SyncAccess GetAccess()
     {
-        return {lock_guard(locker), value};
+        if constexpr (IS_SHARED)
+        {
+            lock_guard upgradeGuard(upgradeLocker);
+            return {lock_guard(locker), value};
+        }
+        else
+        {
+            return {lock_guard(locker), value};
+        }
     }
 
     SyncAccessConst GetAccess() const
     {
-        return {lock_guard(locker), value};
+        return {ReadLock(locker), value};
+    }
+
+    UpgradableAccess GetUpgradableAccess()
+    {
+        static_assert(IS_SHARED, "upgradable access requires a shared mutex");
+        return UpgradableAccess(*this);
+    }
+
+    // Вызывает func под блокировкой и возвращает её результат,
+    // не выпуская объект с блокировкой наружу
+    template <typename Func>
+    auto With(Func func)
+    {
+        auto access = GetAccess();
+        return func(access.ref_to_value);
+    }
+
+    template <typename Func>
+    auto With(Func func) const
+    {
+        auto access = GetAccess();
+        return func(access.ref_to_value);
     }
 
 private:
     T value;
-    mutable mutex locker;
+    mutable Mutex locker;
+    // Упорядочивает писателей и обладателя UpgradableAccess
+    mutable mutex upgradeLocker;
+};
+
+// Ограниченная многопоточная очередь без блокировок на кольцевом буфере:
+// каждая ячейка хранит номер позиции, которую она ожидает, и потоки
+// захватывают позиции через compare_exchange. Блокирующие Push и Pop
+// сначала коротко крутятся, затем уступают процессор и только потом
+// засыпают на условной переменной. Её будят только при наличии ждущих,
+// и ровно столько потоков, сколько элементов или мест появилось.
+template <typename T>
+class MpmcQueue
+{
+public:
+    explicit MpmcQueue(size_t capacity)
+        : _mask(roundUpToPowerOfTwo(capacity) - 1)
+        , _cells(new Cell[_mask + 1])
+    {
+        for (size_t i = 0; i <= _mask; ++i)
+        {
+            _cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    MpmcQueue(const MpmcQueue &) = delete;
+    MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+    size_t Capacity() const
+    {
+        return _mask + 1;
+    }
+
+    bool TryPush(T value)
+    {
+        if (!tryPush(move(value)))
+        {
+            return false;
+        }
+
+        wake(_pushedWaiters, _notEmpty, 1);
+        return true;
+    }
+
+    bool TryPop(T &value)
+    {
+        if (!tryPop(value))
+        {
+            return false;
+        }
+
+        wake(_poppedWaiters, _notFull, 1);
+        return true;
+    }
+
+    void Push(T value)
+    {
+        waitFor(_poppedWaiters, _notFull, [this, &value] { return tryPush(move(value)); });
+        wake(_pushedWaiters, _notEmpty, 1);
+    }
+
+    T Pop()
+    {
+        T value;
+        waitFor(_pushedWaiters, _notEmpty, [this, &value] { return tryPop(value); });
+        wake(_poppedWaiters, _notFull, 1);
+        return value;
+    }
+
+    // Кладёт все элементы диапазона, блокируясь при заполненной очереди.
+    // Элементы копируются; чтобы переместить их, передайте
+    // make_move_iterator. Потребители будятся один раз на каждую порцию.
+    template <typename It>
+    void PushBatch(It first, It last)
+    {
+        while (first != last)
+        {
+            waitFor(_poppedWaiters, _notFull, [this, &first] { return tryPush(*first); });
+
+            size_t count = 1;
+            for (++first; first != last && tryPush(*first); ++first)
+            {
+                ++count;
+            }
+
+            wake(_pushedWaiters, _notEmpty, count);
+        }
+    }
+
+    // Дожидается хотя бы одного элемента и забирает до max_count элементов,
+    // уже лежащих в очереди. Возвращает число забранных элементов.
+    template <typename OutputIt>
+    size_t PopBatch(OutputIt out, size_t max_count)
+    {
+        if (max_count == 0)
+        {
+            return 0;
+        }
+
+        T value;
+        waitFor(_pushedWaiters, _notEmpty, [this, &value] { return tryPop(value); });
+        *out++ = move(value);
+
+        size_t count = 1;
+        for (; count < max_count && tryPop(value); ++count)
+        {
+            *out++ = move(value);
+        }
+
+        wake(_poppedWaiters, _notFull, count);
+        return count;
+    }
+
+private:
+    struct alignas(64) Cell
+    {
+        atomic<size_t> sequence;
+        T data;
+    };
+
+    static const int SPIN_COUNT = 16;
+    static const int YIELD_COUNT = 16;
+
+    const size_t _mask;
+    unique_ptr<Cell[]> _cells;
+    alignas(64) atomic<size_t> _enqueuePos{0};
+    alignas(64) atomic<size_t> _dequeuePos{0};
+
+    alignas(64) atomic<size_t> _pushedWaiters{0};
+    atomic<size_t> _poppedWaiters{0};
+    mutex _locker;
+    condition_variable _notEmpty;
+    condition_variable _notFull;
+
+    static size_t roundUpToPowerOfTwo(size_t value)
+    {
+        size_t result = 2;
+
+        while (result < value)
+        {
+            result *= 2;
+        }
+
+        return result;
+    }
+
+    // Значение копируется или перемещается в ячейку только в случае
+    // успеха, поэтому неудачная попытка не портит аргумент
+    template <typename Value>
+    bool tryPush(Value &&value)
+    {
+        Cell *cell;
+        size_t pos = _enqueuePos.load(memory_order_relaxed);
+
+        for (;;)
+        {
+            cell = &_cells[pos & _mask];
+            size_t seq = cell->sequence.load(memory_order_acquire);
+            auto diff = static_cast<ptrdiff_t>(seq - pos);
+
+            if (diff == 0)
+            {
+                if (_enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = _enqueuePos.load(memory_order_relaxed);
+            }
+        }
+
+        cell->data = forward<Value>(value);
+        cell->sequence.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &value)
+    {
+        Cell *cell;
+        size_t pos = _dequeuePos.load(memory_order_relaxed);
+
+        for (;;)
+        {
+            cell = &_cells[pos & _mask];
+            size_t seq = cell->sequence.load(memory_order_acquire);
+            auto diff = static_cast<ptrdiff_t>(seq - (pos + 1));
+
+            if (diff == 0)
+            {
+                if (_dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = _dequeuePos.load(memory_order_relaxed);
+            }
+        }
+
+        value = move(cell->data);
+        cell->sequence.store(pos + _mask + 1, memory_order_release);
+        return true;
+    }
+
+    template <typename Predicate>
+    void waitFor(atomic<size_t> &waiters, condition_variable &cv, Predicate done)
+    {
+        // Короткое ожидание обычно дешевле засыпания: другая сторона уже
+        // в середине операции. Затем процессор уступается, что важно,
+        // когда потоков больше, чем ядер.
+        for (int i = 0; i < SPIN_COUNT + YIELD_COUNT; ++i)
+        {
+            if (done())
+            {
+                return;
+            }
+
+            if (i < SPIN_COUNT)
+            {
+                cpuRelax();
+            }
+            else
+            {
+                this_thread::yield();
+            }
+        }
+
+        // Счётчик ждущих увеличивается под мьютексом и до повторной проверки,
+        // поэтому wake либо увидит ждущего, либо проверка увидит элемент
+        unique_lock<mutex> lock(_locker);
+        waiters.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        cv.wait(lock, done);
+        waiters.fetch_sub(1);
+    }
+
+    // Каждый из count появившихся элементов (или мест) нужен не более
+    // чем одному ждущему, поэтому будить всех имеет смысл только для порций
+    void wake(atomic<size_t> &waiters, condition_variable &cv, size_t count)
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (waiters.load(memory_order_relaxed) != 0)
+        {
+            lock_guard<mutex> guard(_locker);
+
+            if (count == 1)
+            {
+                cv.notify_one();
+            }
+            else
+            {
+                cv.notify_all();
+            }
+        }
+    }
+
+    static void cpuRelax()
+    {
+#ifdef __SSE2__
+        _mm_pause();
+#endif
+    }
 };
 
 void TestConcurrentUpdate()
@@ -66,6 +436,173 @@ void TestConcurrentUpdate()
     ASSERT_EQUAL(common_string.GetAccess().ref_to_value.size(), 2 * add_count);
 }
 
+void TestSharedReaders()
+{
+    const Synchronized<string, shared_mutex> config("initial");
+
+    auto first_reader = config.GetAccess();
+    auto second_reader = async(launch::async, [&config]
+    {
+        return config.GetAccess().ref_to_value;
+    });
+
+    ASSERT(second_reader.wait_for(chrono::seconds(5)) == future_status::ready);
+    ASSERT_EQUAL(second_reader.get(), first_reader.ref_to_value);
+}
+
+void TestUpgradableAccess()
+{
+    Synchronized<vector<int>, shared_mutex> values;
+
+    auto adder = [&values](int count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            auto access = values.GetUpgradableAccess();
+            if (access.ref_to_value.size() < 1000)
+            {
+                access.Upgrade().push_back(i);
+            }
+        }
+    };
+
+    auto f1 = async(launch::async, adder, 1000);
+    auto f2 = async(launch::async, adder, 1000);
+    f1.get();
+    f2.get();
+
+    ASSERT_EQUAL(as_const(values).GetAccess().ref_to_value.size(), 1000u);
+}
+
+void TestWith()
+{
+    Synchronized<string> plain("a");
+    plain.With([](string &value)
+    {
+        value += 'b';
+    });
+    ASSERT_EQUAL(as_const(plain).With([](const string &value)
+    {
+        return value.size();
+    }), 2u);
+
+    Synchronized<string, shared_timed_mutex> shared("a");
+    shared.With([](string &value)
+    {
+        value += 'c';
+    });
+    ASSERT_EQUAL(as_const(shared).With([](const string &value)
+    {
+        return value;
+    }), "ac");
+}
+
+void TestCombinableCounter()
+{
+    const size_t thread_count = 4;
+    const size_t add_count = 200000;
+
+    Synchronized<size_t> synchronized_counter;
+    Combinable<size_t> combinable_counter;
+
+    {
+        LOG_DURATION("Synchronized counter");
+        vector<future<void>> futures;
+        for (size_t i = 0; i < thread_count; ++i)
+        {
+            futures.push_back(async(launch::async, [&synchronized_counter, add_count]
+            {
+                for (size_t i = 0; i < add_count; ++i)
+                {
+                    ++synchronized_counter.GetAccess().ref_to_value;
+                }
+            }));
+        }
+    }
+    {
+        LOG_DURATION("Combinable counter");
+        vector<future<void>> futures;
+        for (size_t i = 0; i < thread_count; ++i)
+        {
+            futures.push_back(async(launch::async, [&combinable_counter, add_count]
+            {
+                for (size_t i = 0; i < add_count; ++i)
+                {
+                    ++combinable_counter.GetAccess().ref_to_value;
+                }
+            }));
+        }
+    }
+
+    const auto sum = [](size_t &result, size_t shard)
+    {
+        result += shard;
+    };
+
+    ASSERT_EQUAL(synchronized_counter.GetAccess().ref_to_value, thread_count * add_count);
+    ASSERT(combinable_counter.ShardCount() <= thread_count);
+    ASSERT_EQUAL(combinable_counter.Combine(sum), thread_count * add_count);
+}
+
+void TestCombinableShardReuse()
+{
+    Combinable<size_t> counter;
+
+    // Потоки идут один за другим: шард завершившегося потока
+    // со всем накопленным достаётся следующему
+    for (size_t round = 0; round < 10; ++round)
+    {
+        async(launch::async, [&counter]
+        {
+            ++counter.GetAccess().ref_to_value;
+        }).get();
+    }
+
+    ASSERT_EQUAL(counter.ShardCount(), 1u);
+    ASSERT_EQUAL(counter.Combine([](size_t &result, size_t shard)
+    {
+        result += shard;
+    }), 10u);
+
+    // Экземпляры, созданные и уничтоженные в одном потоке, удаляют свои
+    // записи из реестра потока, и новый экземпляр начинает с нуля
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        Combinable<size_t> local;
+        ASSERT_EQUAL(local.GetAccess().ref_to_value++, 0u);
+    }
+}
+
+void TestCombinableString()
+{
+    Combinable<string> common_string;
+
+    const size_t add_count = 50000;
+    auto updater = [&common_string, add_count](char c)
+    {
+        for (size_t i = 0; i < add_count; ++i)
+        {
+            common_string.GetAccess().ref_to_value += c;
+        }
+    };
+
+    auto f1 = async(launch::async, updater, 'a');
+    auto f2 = async(launch::async, updater, 'b');
+
+    f1.get();
+    f2.get();
+
+    const string result = common_string.Combine([](string &result, const string &shard)
+    {
+        result += shard;
+    });
+
+    ASSERT_EQUAL(result.size(), 2 * add_count);
+    ASSERT_EQUAL(static_cast<size_t>(count(result.begin(), result.end(), 'a')), add_count);
+    ASSERT(result == string(add_count, 'a') + string(add_count, 'b')
+           || result == string(add_count, 'b') + string(add_count, 'a'));
+}
+
 vector<int> Consume(Synchronized<deque<int>> &common_queue)
 {
     vector<int> got;
@@ -102,6 +639,45 @@ vector<int> Consume(Synchronized<deque<int>> &common_queue)
     }
 }
 
+// В отличие от варианта с deque, потребителей может быть несколько:
+// каждый забирает элементы по одному и завершается на своём
+// отрицательном элементе, не трогая чужие
+vector<int> ConsumeMpmc(MpmcQueue<int> &common_queue)
+{
+    vector<int> got;
+
+    for (int item = common_queue.Pop(); item > 0; item = common_queue.Pop())
+    {
+        got.push_back(item);
+    }
+
+    return got;
+}
+
+// Забирает всё, что лежит в очереди, одной порцией, как Consume для deque.
+// Рассчитан на единственного потребителя.
+vector<int> ConsumeMpmcBatches(MpmcQueue<int> &common_queue)
+{
+    vector<int> got;
+    vector<int> batch;
+
+    for (;;)
+    {
+        batch.clear();
+        common_queue.PopBatch(back_inserter(batch), common_queue.Capacity());
+
+        for (int item : batch)
+        {
+            if (item <= 0)
+            {
+                return got;
+            }
+
+            got.push_back(item);
+        }
+    }
+}
+
 void Log(const Synchronized<deque<int>> &common_queue, ostream &out)
 {
     for (int i = 0; i < 100; ++i)
@@ -134,9 +710,158 @@ void TestProducerConsumer()
     ASSERT(!logs.empty());
 }
 
+void TestMpmcQueue()
+{
+    MpmcQueue<string> queue(3);
+    ASSERT_EQUAL(queue.Capacity(), 4u);
+
+    for (const string s : {"a", "b", "c", "d"})
+    {
+        ASSERT(queue.TryPush(s));
+    }
+    ASSERT(!queue.TryPush("e"));
+
+    string value;
+    ASSERT(queue.TryPop(value));
+    ASSERT_EQUAL(value, "a");
+    ASSERT(queue.TryPush("e"));
+
+    vector<string> rest;
+    ASSERT_EQUAL(queue.PopBatch(back_inserter(rest), 10), 4u);
+    ASSERT_EQUAL(rest, vector<string>({"b", "c", "d", "e"}));
+    ASSERT(!queue.TryPop(value));
+
+    // Порция копируется из константного диапазона и перемещается
+    // из диапазона под make_move_iterator
+    const vector<string> copied = {"f", "g"};
+    queue.PushBatch(copied.begin(), copied.end());
+    ASSERT_EQUAL(copied, vector<string>({"f", "g"}));
+
+    vector<string> moved = {"h", "i"};
+    queue.PushBatch(make_move_iterator(moved.begin()), make_move_iterator(moved.end()));
+    ASSERT(moved[0].empty() && moved[1].empty());
+
+    rest.clear();
+    ASSERT_EQUAL(queue.PopBatch(back_inserter(rest), 10), 4u);
+    ASSERT_EQUAL(rest, vector<string>({"f", "g", "h", "i"}));
+}
+
+void TestMpmcProducerConsumer()
+{
+    MpmcQueue<int> common_queue(1024);
+
+    auto consumer = async(launch::async, [&common_queue]
+    {
+        return ConsumeMpmc(common_queue);
+    });
+
+    const size_t item_count = 100000;
+    vector<int> expected(item_count);
+    iota(begin(expected), end(expected), 1);
+
+    common_queue.PushBatch(expected.begin(), expected.end());
+    common_queue.Push(-1);
+
+    ASSERT_EQUAL(consumer.get(), expected);
+}
+
+// Пропускная способность передачи элементов между несколькими
+// производителями и потребителями: прежний вариант с опросом
+// Synchronized<deque<int>> против MpmcQueue
+void TestProducerConsumerThroughput()
+{
+    const size_t producer_count = 2;
+    const size_t item_count = 200000;
+    const long long expected_sum =
+        static_cast<long long>(producer_count) * item_count * (item_count + 1) / 2;
+
+    auto run = [&](auto &common_queue, auto push, auto consume, size_t consumer_count)
+    {
+        vector<future<vector<int>>> consumers;
+        for (size_t i = 0; i < consumer_count; ++i)
+        {
+            consumers.push_back(async(launch::async, consume, ref(common_queue)));
+        }
+
+        {
+            vector<future<void>> producers;
+            for (size_t i = 0; i < producer_count; ++i)
+            {
+                producers.push_back(async(launch::async, [&common_queue, push, item_count]
+                {
+                    for (size_t i = 1; i <= item_count; ++i)
+                    {
+                        push(common_queue, static_cast<int>(i));
+                    }
+                }));
+            }
+        }
+
+        for (size_t i = 0; i < consumer_count; ++i)
+        {
+            push(common_queue, -1);
+        }
+
+        long long total = 0;
+        for (auto &f : consumers)
+        {
+            for (int item : f.get())
+            {
+                total += item;
+            }
+        }
+        return total;
+    };
+
+    {
+        LOG_DURATION("Synchronized<deque<int>>");
+        Synchronized<deque<int>> common_queue;
+        ASSERT_EQUAL(run(common_queue, [](Synchronized<deque<int>> &q, int item)
+        {
+            q.GetAccess().ref_to_value.push_back(item);
+        }, [](Synchronized<deque<int>> &q)
+        {
+            return Consume(q);
+        }, 1), expected_sum);
+    }
+    {
+        LOG_DURATION("MpmcQueue");
+        MpmcQueue<int> common_queue(4096);
+        ASSERT_EQUAL(run(common_queue, [](MpmcQueue<int> &q, int item)
+        {
+            q.Push(item);
+        }, ConsumeMpmc, 1), expected_sum);
+    }
+    {
+        LOG_DURATION("MpmcQueue, PopBatch");
+        MpmcQueue<int> common_queue(4096);
+        ASSERT_EQUAL(run(common_queue, [](MpmcQueue<int> &q, int item)
+        {
+            q.Push(item);
+        }, ConsumeMpmcBatches, 1), expected_sum);
+    }
+    {
+        LOG_DURATION("MpmcQueue, 2 consumers");
+        MpmcQueue<int> common_queue(4096);
+        ASSERT_EQUAL(run(common_queue, [](MpmcQueue<int> &q, int item)
+        {
+            q.Push(item);
+        }, ConsumeMpmc, 2), expected_sum);
+    }
+}
+
 int main()
 {
     TestRunner tr;
     RUN_TEST(tr, TestConcurrentUpdate);
+    RUN_TEST(tr, TestSharedReaders);
+    RUN_TEST(tr, TestUpgradableAccess);
+    RUN_TEST(tr, TestWith);
+    RUN_TEST(tr, TestCombinableCounter);
+    RUN_TEST(tr, TestCombinableString);
+    RUN_TEST(tr, TestCombinableShardReuse);
     RUN_TEST(tr, TestProducerConsumer);
+    RUN_TEST(tr, TestMpmcQueue);
+    RUN_TEST(tr, TestMpmcProducerConsumer);
+    RUN_TEST(tr, TestProducerConsumerThroughput);
 }